@@ -15,11 +15,18 @@
  */
 
 #define _GNU_SOURCE
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
 #include <linux/random.h>
 #include <linux/reboot.h>
+#include <net/if.h>
+#include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -28,8 +35,12 @@
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/reboot.h>
+#include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/swap.h>
 #include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -43,31 +54,175 @@
 #define DEFAULT_PATH "/usr/local/bin:/bin:/usr/bin"
 #define DEFAULT_SHELL "/bin/bash"
 
+static Config *read_config(int fd);
+static void send_status(int fd, const Status *status);
 static void handle_random(size_t len, uint8_t *data);
 static void handle_tty_raw(const char *dev);
-static void handle_mount(const Mount *mnt);
-static bool handle_run(const Run *run);
-static void handle_sigchld(int sig, siginfo_t *info, void *ctx);
+static void handle_interface(const Interface *iface);
+static void handle_swap(const char *dev);
+static void handle_mount(const Mount *mnt, size_t index);
+static void mount_or_fallback(const Mount *mnt, const char *dir, unsigned long flags);
+static void mount_target(const Mount *mnt, char *target, size_t size);
+static void overlay_dir(size_t index, const char *part, char *dir, size_t size);
+struct member;
+static bool run_group(Run *const *runs, size_t first, size_t n, int status_fd);
+static void reap_members(struct member *members, size_t n);
+static void report_member(int status_fd, struct member *m);
+static pid_t start_run(const Run *run, bool *truncated, int *relay_in);
+struct spawn;
+static void spawn_prepare(struct spawn *sp);
+static int spawn_child(void *arg);
+static void spawn_fail(struct spawn *sp, const char *msg);
+static void spawn_open(struct spawn *sp, int new_fd, const char *path, int flags, int fallback_fd);
+static void spawn_free(struct spawn *sp);
+static void report_run(int fd, const RunResult *result);
+static void mark_phase(const char *name);
+static uint64_t monotonic_us(void);
+static void relay_add(int in, int out, const Run *run, pid_t group, bool *truncated);
+static bool relay_open(int in);
+static void relay_pump(size_t i);
+static size_t relay_lines(size_t i, const char *buf, size_t len);
+static void relay_overflow(size_t i);
+static void relay_drain(void);
+static void feed_pump(size_t i);
+static void feed_close(size_t i);
+static void kill_group(pid_t group, uint32_t grace_ms);
+static uint64_t kill_due(uint64_t now);
+static void run_job(const Config *cfg, int status_fd);
+static void end_job(const Config *cfg);
+static void prefetch_start(const Config *cfg);
+static void *prefetch_thread(void *arg);
+static void prefetch_end(void);
+static void reset_tty(const char *dev);
+static void sync_mounts(const Config *cfg);
+static void collect_outputs(const Config *cfg);
+static int collect_entry(const char *path, const struct stat *st, int type, struct FTW *ftw);
+static bool tar_header(const char *name, const struct stat *st, char type, const char *link);
+struct tar_block;
+static bool tar_put(struct tar_block *h);
+static bool tar_write(const void *buf, size_t len);
 
 static void fail(const char *msg);
 static void open_to(int new_fd, const char *path, int flags, int fallback_fd);
 static ssize_t readall(int fd, void *buf, size_t count);
+static ssize_t writeall(int fd, const void *buf, size_t count);
 static void mkdirs(const char *dir);
-static void hostify(const char *cwd, bool user, uid_t uid, gid_t gid);
-static void set_limits(size_t n_limit, Limit **limit);
+static void hostify(struct spawn *sp);
+static void set_limits(struct spawn *sp);
 static void dump_config(uint32_t len, const Config *cfg);
 
-static int in_init = 1; // used to modify behavior of fail for children
+// a run's child between clone and exec: it shares init's memory (and init
+// waits) until then, so everything is prepared beforehand, and a failure is
+// only recorded for init to report
+struct spawn {
+  const Run *run;
+  uid_t uid;
+  gid_t gid;
+  int out_flags;
+  int relay_fd; // write end of the relay pipe, or -1
+  int feed_fd; // read end of the input feed pipe, or -1
+  char **argv; // DEFAULT_SHELL, cmd, args...
+  char **envp, *env_strings;
+  const char *path; // to search for cmd, or NULL if it has a slash
+  char *cmd_buf;
+  const char *failed; // what failed, with errno in error
+  int error;
+};
+static char spawn_stack[65536] __attribute__((aligned(16)));
+
+// output relays for cat_output runs: pipe read end -> output device, with
+// what's left of the run's output caps (NO_CAP if it has none)
+#define MAX_RELAYS 16
+#define RELAY_CHUNK 65536
+#define NO_CAP UINT64_MAX
+static struct {
+  int in, out;
+  uint64_t bytes_left, lines_left;
+  pid_t group;
+  uint32_t grace_ms;
+  bool *truncated;
+} relays[MAX_RELAYS];
+static size_t n_relays = 0;
+
+// input feeds for runs with input_length: input -> pipe write end, with how
+// much of the input is left to pass on
+#define MAX_FEEDS 4
+static struct { int in, out; uint64_t left; } feeds[MAX_FEEDS];
+static size_t n_feeds = 0;
+
+// tar stream being written by collect_outputs; nftw has no context argument
+struct tar_block {
+  char name[100], mode[8], uid[8], gid[8], size[12], mtime[12], chksum[8], type;
+  char link[100], magic[6], version[2], uname[32], gname[32], devmajor[8], devminor[8];
+  char prefix[155], pad[12];
+};
+static struct {
+  int fd;
+  const char *root;
+  size_t index;
+  bool failed;
+} tar;
+
+// files being read by the prefetch threads, which keep them open until the
+// job ends: an open file keeps its hostfs dentry, and so its inode and pages
+#define PREFETCH_THREADS 4
+static struct {
+  char *const *paths;
+  size_t n, next; // next is claimed atomically
+  int *fds;
+  pthread_t threads[PREFETCH_THREADS];
+  size_t n_threads;
+} prefetch;
+
+// boot timeline, sent on the status device when the configuration asks
+#define MAX_PHASES 16
+static Phase phase_buf[MAX_PHASES];
+static Phase *phases[MAX_PHASES];
+static size_t n_phases = 0;
+
+// process groups being killed, to SIGKILL once their grace period is over
+#define MAX_KILLS 32
+static struct { pid_t group; uint64_t at_us; } kills[MAX_KILLS];
+static size_t n_kills = 0;
+
+// a non-daemon run of the group being run, until it has been reported
+struct member {
+  const Run *run;
+  RunResult result;
+  pid_t pid; // 0 once reaped
+  int relay_in; // relay pipe, or -1
+  uint64_t deadline_us; // for timeout_ms, or 0
+  bool truncated, reported;
+};
+
+// SIGCHLD stays blocked in init, and arrives on sigchld_fd instead; runs get
+// the signal mask init started with
+static int sigchld_fd = -1;
+static sigset_t run_mask;
 
 #define MUST(msg, err, func, ...) ({ \
   __typeof__(err) ret = func(__VA_ARGS__); \
   if (ret == err) fail(msg); \
   ret; })
 
+// as MUST, in a spawned child
+#define CHILD_MUST(sp, msg, err, func, ...) ({ \
+  __typeof__(err) ret = func(__VA_ARGS__); \
+  if (ret == err) spawn_fail(sp, msg); \
+  ret; })
+
+#define CONFIG_MAGIC 0xdeadbeefu
+
 int main()
 {
+  mark_phase("init");
   srandom(time(NULL));
 
+  // with umlbox_control=/ttyN on the kernel command line, the configuration
+  // comes from that console instead of /config, once we've said we're ready
+  const char *control_dev = getenv("umlbox_control");
+  if (control_dev) control_dev = strdup(control_dev);
+
   // prepare initial environment
 
   MUST("mknod /console", -1, mknod, "/console", 0644 | S_IFCHR, makedev(5, 1));
@@ -77,8 +232,17 @@ int main()
 
   printf("umlbox init\n");
 
-  MUST("mknod /ubda", -1, mknod, "/ubda", 0644 | S_IFBLK, makedev(98, 0));
   MUST("mknod /null", -1, mknod, "/null", 0644 | S_IFCHR, makedev(1, 3));
+  MUST("mknod /random", -1, mknod, "/random", 0644 | S_IFCHR, makedev(1, 8));
+  {
+    // block devices the launcher may attach, e.g. for bulk input or images
+    // of host trees (all 16 that UML has)
+    char dev[sizeof "/ubdX"];
+    for (int i = 0; i < 16; i++) {
+      snprintf(dev, sizeof dev, "/ubd%c", 'a' + i);
+      MUST("mknod /ubdX", -1, mknod, dev, 0644 | S_IFBLK, makedev(98, 16 * i));
+    }
+  }
   {
     char dev[sizeof "/ttyXX"];
     for (int i = 1; i < 16; i++) {
@@ -96,60 +260,390 @@ int main()
   MUST("mkdir /host", -1, mkdir, "/host", 0777u);
 
   {
-    struct sigaction act = {
-      .sa_sigaction = handle_sigchld,
-      .sa_flags = SA_SIGINFO,
-    };
-    MUST("sigaction", -1, sigaction, SIGCHLD, &act, NULL);
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    MUST("sigprocmask (block SIGCHLD)", -1, sigprocmask, SIG_BLOCK, &chld_mask, &run_mask);
+    sigchld_fd = MUST("signalfd", -1, signalfd, -1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
   }
 
-  // parse the configuration
-
-  Config *cfg;
-  {
-    int fd = MUST("open /ubda", -1, open, "/ubda", O_RDONLY);
-
-    uint32_t hdr[2];
-    MUST("read /ubda header", -1, readall, fd, hdr, sizeof hdr);
-    if (hdr[0] != 0xdeadbeefu) {
-      printf("unexpected header: %#08x != 0xdeadbeef\n", (unsigned) hdr[0]);
-      errno = EINVAL, fail("bad /ubda header");
+  mark_phase("devices");
+
+  // with a control channel, serve jobs until the host shuts us down
+
+  if (control_dev) {
+    handle_tty_raw(control_dev);
+    int control = MUST("open control", -1, open, control_dev, O_RDWR | O_CLOEXEC);
+
+    while (true) {
+      Status ready = STATUS__INIT;
+      ready.ready = true;
+      send_status(control, &ready);
+
+      Config *cfg = read_config(control);
+      mark_phase("config");
+      run_job(cfg, control);
+      n_phases = 0;
+      sync_mounts(cfg);
+
+      // everything the job wrote has reached the host once we say we're done
+      end_job(cfg);
+      Status done = STATUS__INIT;
+      done.done = true;
+      send_status(control, &done);
+
+      for (size_t i = cfg->n_mount; i > 0; i--) {
+        const Mount *mnt = cfg->mount[i-1];
+        char target[sizeof "/host/" + strlen(mnt->target)];
+        mount_target(mnt, target, sizeof target);
+        if (umount2(target, MNT_DETACH) == -1)
+          printf("umlbox umount: %s: %s\n", target, strerror(errno));
+        if (mnt->overlay) {
+          char dir[sizeof "/overlay/" + 3 * sizeof (size_t) + sizeof "/lower"];
+          overlay_dir(i-1, "rw", dir, sizeof dir);
+          umount2(dir, MNT_DETACH);
+          overlay_dir(i-1, "lower", dir, sizeof dir);
+          umount2(dir, MNT_DETACH);
+        }
+      }
+      config__free_unpacked(cfg, 0);
     }
+  }
 
-    uint8_t *data = MUST("malloc config", (void *) 0, malloc, hdr[1]);
-    MUST("read config", -1, readall, fd, data, hdr[1]);
-    cfg = config__unpack(0, hdr[1], data);
-    if (!cfg)
-      errno = EINVAL, fail("bad config");
+  // otherwise run the one job in /config, which the launcher puts in the
+  // initramfs
 
-    close(fd);
-    dump_config(hdr[1], cfg);
+  int fd = MUST("open /config", -1, open, "/config", O_RDONLY);
+  Config *cfg = read_config(fd);
+  close(fd);
+  mark_phase("config");
+
+  run_job(cfg, -1);
+  collect_outputs(cfg);
+  sync_mounts(cfg);
+
+  // the host may kill us as soon as it hears we're done, so everything the
+  // job wrote must be on its way out by then
+  if (cfg->fast_exit && *cfg->status) {
+    end_job(cfg);
+    int status_fd = MUST("open status", -1, open, cfg->status, O_WRONLY);
+    Status done = STATUS__INIT;
+    done.done = true;
+    send_status(status_fd, &done);
+    tcdrain(status_fd);
   }
 
-  // execute all the actions
+  reboot(LINUX_REBOOT_CMD_POWER_OFF);
+  return 0;
+}
 
+static void run_job(const Config *cfg, int status_fd) {
   if (cfg->random.len > 0)
     handle_random(cfg->random.len, cfg->random.data);
+  mark_phase("random");
 
   for (size_t i = 0; i < cfg->n_tty_raw; i++)
     handle_tty_raw(cfg->tty_raw[i]);
+  mark_phase("tty_raw");
+
+  for (size_t i = 0; i < cfg->n_interface; i++)
+    handle_interface(cfg->interface[i]);
+  mark_phase("interfaces");
 
+  if (*cfg->swap)
+    handle_swap(cfg->swap);
   for (size_t i = 0; i < cfg->n_mount; i++)
-    handle_mount(cfg->mount[i]);
+    handle_mount(cfg->mount[i], i);
+  mark_phase("mounts");
 
-  for (size_t i = 0; i < cfg->n_run; i++) {
-    bool timed_out = handle_run(cfg->run[i]);
-    if (timed_out)
+  // overlaps with the first runs, which need the same files
+  prefetch_start(cfg);
+
+  int own_status_fd = -1;
+  if (*cfg->status)
+    status_fd = own_status_fd = MUST("open status", -1, open, cfg->status, O_WRONLY | O_CLOEXEC);
+
+  if (cfg->profile && status_fd != -1) {
+    Status status = STATUS__INIT;
+    status.n_phase = n_phases;
+    status.phase = phases;
+    send_status(status_fd, &status);
+  }
+
+  // runs next to each other with the same nonzero group start together
+  for (size_t i = 0, n; i < cfg->n_run; i += n) {
+    n = 1;
+    if (cfg->run[i]->group)
+      while (i + n < cfg->n_run && cfg->run[i + n]->group == cfg->run[i]->group)
+        n++;
+    if (run_group(cfg->run + i, i, n, status_fd))
       break;
   }
 
-  sync();
-  reboot(LINUX_REBOOT_CMD_POWER_OFF);
+  if (own_status_fd != -1)
+    close(own_status_fd);
+}
+
+static void report_run(int fd, const RunResult *result) {
+  Status status = STATUS__INIT;
+  status.result = (RunResult *) result;
+  send_status(fd, &status);
+}
+
+static void end_job(const Config *cfg) {
+  // kill whatever the job left behind: daemons, stragglers after a timeout
+  kill(-1, SIGKILL);
+  while (waitpid(-1, 0, 0) != -1 || errno == EINTR)
+    ;
+  relay_drain();
+  while (n_feeds > 0)
+    feed_close(n_feeds - 1);
+  n_kills = 0;
+  prefetch_end();
+
+  for (size_t i = 0; i < cfg->n_run; i++) {
+    const Run *run = cfg->run[i];
+    reset_tty(run->input);
+    reset_tty(run->output);
+    reset_tty(run->error);
+  }
+}
+
+static void prefetch_start(const Config *cfg) {
+  if (!cfg->n_prefetch)
+    return;
+  prefetch.paths = cfg->prefetch;
+  prefetch.n = cfg->n_prefetch;
+  prefetch.next = 0;
+  prefetch.fds = MUST("calloc (prefetch)", (void *) 0, calloc, prefetch.n, sizeof *prefetch.fds);
+  for (size_t i = 0; i < prefetch.n; i++)
+    prefetch.fds[i] = -1;
+
+  // only a head start: without threads, the runs read the files themselves
+  for (size_t i = 0; i < PREFETCH_THREADS && i < prefetch.n; i++)
+    if (pthread_create(&prefetch.threads[prefetch.n_threads], 0, prefetch_thread, 0) == 0)
+      prefetch.n_threads++;
+}
+
+static void *prefetch_thread(void *arg) {
+  (void) arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&prefetch.next, 1, __ATOMIC_RELAXED)) < prefetch.n) {
+    char path[sizeof "/host" + strlen(prefetch.paths[i])];
+    snprintf(path, sizeof path, "/host%s", prefetch.paths[i]);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+      readahead(fd, 0, st.st_size);
+    prefetch.fds[i] = fd;
+  }
   return 0;
 }
 
+static void prefetch_end(void) {
+  for (size_t i = 0; i < prefetch.n_threads; i++)
+    pthread_join(prefetch.threads[i], 0);
+  for (size_t i = 0; i < prefetch.n; i++)
+    if (prefetch.fds[i] != -1)
+      close(prefetch.fds[i]);
+  free(prefetch.fds);
+  memset(&prefetch, 0, sizeof prefetch);
+}
+
+static void reset_tty(const char *dev) {
+  if (!*dev)
+    return;
+  int fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd == -1)
+    return;
+  if (isatty(fd)) {
+    tcdrain(fd);
+    tcflush(fd, TCIFLUSH);
+  }
+  close(fd);
+}
+
+static void sync_mounts(const Config *cfg) {
+  // hostfs writes go straight through to the host, so this is only for
+  // mmap'd writes and block devices; in-memory filesystems have nothing to do
+  static const char *const volatile_fs[] = { "tmpfs", "ramfs", "proc", "sysfs", "devpts" };
+
+  for (size_t i = 0; i < cfg->n_mount; i++) {
+    const Mount *mnt = cfg->mount[i];
+    if (mnt->ro || mnt->overlay)
+      continue;
+    bool skip = false;
+    for (size_t j = 0; j < sizeof volatile_fs / sizeof *volatile_fs; j++)
+      if (strcmp(mnt->fstype, volatile_fs[j]) == 0)
+        skip = true;
+    if (skip)
+      continue;
+
+    char target[sizeof "/host/" + strlen(mnt->target)];
+    mount_target(mnt, target, sizeof target);
+    int fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    if (syncfs(fd) == -1)
+      printf("umlbox syncfs: %s: %s\n", target, strerror(errno));
+    close(fd);
+  }
+}
+
+static void collect_outputs(const Config *cfg) {
+  if (!cfg->n_collect || !*cfg->collect_device)
+    return;
+
+  tar.fd = MUST("open collect", -1, open, cfg->collect_device, O_WRONLY | O_CLOEXEC);
+  tar.failed = false;
+  for (size_t i = 0; i < cfg->n_collect && !tar.failed; i++) {
+    char root[sizeof "/host/" + strlen(cfg->collect[i])];
+    snprintf(root, sizeof root, "/host%s%s", *cfg->collect[i] == '/' ? "" : "/", cfg->collect[i]);
+    printf("umlbox collect: %s\n", root);
+    tar.root = root;
+    tar.index = i;
+    if (nftw(root, collect_entry, 16, FTW_PHYS) == -1 && !tar.failed)
+      printf("umlbox collect: %s: %s\n", root, strerror(errno));
+  }
+
+  // the end of the archive, and everything on its way to the host
+  static const char end[1024];
+  tar_write(end, sizeof end);
+  if (fsync(tar.fd) == -1)
+    tar.failed = true;
+  if (tar.failed)
+    printf("umlbox collect: writing %s: %s\n", cfg->collect_device, strerror(errno));
+  close(tar.fd);
+}
+
+static int collect_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  // entries are named after the collect index, then the path under its root
+  const char *rel = path + strlen(tar.root);
+  char name[sizeof "18446744073709551615" + strlen(rel) + 1];
+  snprintf(name, sizeof name, "%zu%s%s", tar.index, rel, type == FTW_D ? "/" : "");
+
+  if (type == FTW_D) {
+    tar_header(name, st, '5', "");
+  } else if (type == FTW_SL) {
+    char link[PATH_MAX];
+    ssize_t len = readlink(path, link, sizeof link - 1);
+    if (len == -1)
+      return 0;
+    link[len] = 0;
+    tar_header(name, st, '2', link);
+  } else if (type == FTW_F && S_ISREG(st->st_mode)) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      printf("umlbox collect: %s: %s\n", path, strerror(errno));
+      return 0;
+    }
+    if (tar_header(name, st, '0', "")) {
+      // exactly st_size bytes, padded to a whole block, even if it has changed
+      static char buf[65536];
+      off_t left = st->st_size;
+      while (left > 0 && !tar.failed) {
+        ssize_t got = read(fd, buf, left < (off_t) sizeof buf ? (size_t) left : sizeof buf);
+        if (got <= 0) {
+          got = left < (off_t) sizeof buf ? (size_t) left : sizeof buf;
+          memset(buf, 0, got);
+        }
+        tar_write(buf, got);
+        left -= got;
+      }
+      static const char pad[512];
+      tar_write(pad, -st->st_size & 511);
+    }
+    close(fd);
+  }
+  return tar.failed ? -1 : 0;
+}
+
+// writes a ustar header, preceded by GNU long name records if needed
+static bool tar_header(const char *name, const struct stat *st, char type, const char *link) {
+  static const char pad[512];
+  struct tar_block h;
+
+  const char *long_names[2] = {
+    strlen(name) >= sizeof h.name ? name : 0,
+    strlen(link) >= sizeof h.link ? link : 0,
+  };
+  for (int i = 0; i < 2; i++) {
+    if (!long_names[i])
+      continue;
+    size_t len = strlen(long_names[i]) + 1;
+    memset(&h, 0, sizeof h);
+    strcpy(h.name, "././@LongLink");
+    strcpy(h.mode, "0000644");
+    snprintf(h.size, sizeof h.size, "%011llo", (unsigned long long) len);
+    h.type = i == 0 ? 'L' : 'K';
+    tar_put(&h);
+    tar_write(long_names[i], len);
+    tar_write(pad, -len & 511);
+  }
+
+  memset(&h, 0, sizeof h);
+  strncpy(h.name, name, sizeof h.name);
+  snprintf(h.mode, sizeof h.mode, "%07o", (unsigned) st->st_mode & 07777);
+  snprintf(h.uid, sizeof h.uid, "%07o", (unsigned) st->st_uid & 07777777);
+  snprintf(h.gid, sizeof h.gid, "%07o", (unsigned) st->st_gid & 07777777);
+  snprintf(h.size, sizeof h.size, "%011llo", type == '0' ? (unsigned long long) st->st_size : 0ull);
+  snprintf(h.mtime, sizeof h.mtime, "%011llo", (unsigned long long) st->st_mtime);
+  h.type = type;
+  strncpy(h.link, link, sizeof h.link);
+  return tar_put(&h);
+}
+
+// fills in the GNU magic and the checksum, and writes the block
+static bool tar_put(struct tar_block *h) {
+  memcpy(h->magic, "ustar ", sizeof h->magic);
+  memcpy(h->version, " ", sizeof h->version);
+  memset(h->chksum, ' ', sizeof h->chksum);
+  unsigned sum = 0;
+  for (size_t i = 0; i < sizeof *h; i++)
+    sum += ((unsigned char *) h)[i];
+  snprintf(h->chksum, sizeof h->chksum, "%06o", sum);
+  return tar_write(h, sizeof *h);
+}
+
+static bool tar_write(const void *buf, size_t len) {
+  if (!tar.failed && writeall(tar.fd, buf, len) == -1)
+    tar.failed = true;
+  return !tar.failed;
+}
+
+static Config *read_config(int fd) {
+  uint32_t hdr[2];
+  MUST("read config header", -1, readall, fd, hdr, sizeof hdr);
+  if (hdr[0] != CONFIG_MAGIC) {
+    printf("unexpected header: %#08x != 0xdeadbeef\n", (unsigned) hdr[0]);
+    errno = EINVAL, fail("bad config header");
+  }
+
+  uint8_t *data = MUST("malloc config", (void *) 0, malloc, hdr[1]);
+  MUST("read config", -1, readall, fd, data, hdr[1]);
+  Config *cfg = config__unpack(0, hdr[1], data);
+  if (!cfg)
+    errno = EINVAL, fail("bad config");
+  free(data);
+
+  dump_config(hdr[1], cfg);
+  return cfg;
+}
+
+static void send_status(int fd, const Status *status) {
+  size_t len = status__get_packed_size(status);
+  uint32_t *buf = MUST("malloc status", (void *) 0, malloc, 2 * sizeof *buf + len);
+  buf[0] = CONFIG_MAGIC;
+  buf[1] = len;
+  status__pack(status, (uint8_t *) (buf + 2));
+  // in a single write, so the host never sees a partial record
+  MUST("write status", -1, writeall, fd, buf, 2 * sizeof *buf + len);
+  free(buf);
+}
+
 static void handle_random(size_t len, uint8_t *data) {
-  MUST("mknod /random", -1, mknod, "/random", 0644 | S_IFCHR, makedev(1, 8));
   int fd = MUST("open /random", -1, open, "/random", O_RDONLY);
 
   struct rand_pool_info *info = MUST("malloc rand_pool_info", (void *) 0, malloc, sizeof *info + len);
@@ -175,9 +669,60 @@ static void handle_tty_raw(const char *dev) {
   close(fd);
 }
 
-static void handle_mount(const Mount *mnt) {
+static void handle_interface(const Interface *iface) {
+  printf("umlbox interface: %s %s/%u\n", iface->name, iface->address, (unsigned) iface->prefix);
+
+  int sock = MUST("socket", -1, socket, AF_INET, SOCK_DGRAM, 0);
+
+  struct ifreq req;
+  memset(&req, 0, sizeof req);
+  snprintf(req.ifr_name, sizeof req.ifr_name, "%s", iface->name);
+
+  if (*iface->address) {
+    struct sockaddr_in *addr = (struct sockaddr_in *) &req.ifr_addr;
+    addr->sin_family = AF_INET;
+    if (inet_pton(AF_INET, iface->address, &addr->sin_addr) != 1)
+      errno = EINVAL, fail("bad interface address");
+    MUST("ioctl SIOCSIFADDR", -1, ioctl, sock, SIOCSIFADDR, &req);
+
+    struct sockaddr_in *mask = (struct sockaddr_in *) &req.ifr_netmask;
+    mask->sin_family = AF_INET;
+    mask->sin_addr.s_addr = htonl(iface->prefix ? ~0u << (32 - (iface->prefix > 32 ? 32 : iface->prefix)) : 0);
+    MUST("ioctl SIOCSIFNETMASK", -1, ioctl, sock, SIOCSIFNETMASK, &req);
+  }
+
+  if (iface->up) {
+    MUST("ioctl SIOCGIFFLAGS", -1, ioctl, sock, SIOCGIFFLAGS, &req);
+    req.ifr_flags |= IFF_UP;
+    MUST("ioctl SIOCSIFFLAGS", -1, ioctl, sock, SIOCSIFFLAGS, &req);
+  }
+
+  close(sock);
+}
+
+static void handle_swap(const char *dev) {
+  // a swap area is just its first page, so there's nothing to mkswap: version
+  // 1 of union swap_header after the 1024-byte boot block, and the magic at
+  // the end of the page; the rest of the (sparse) device is never read
+  // before it has been written
+  long page = sysconf(_SC_PAGESIZE);
+  int fd = MUST("open swap", -1, open, dev, O_RDWR | O_CLOEXEC);
+  off_t size = MUST("lseek swap", (off_t) -1, lseek, fd, 0, SEEK_END);
+
+  uint32_t *header = MUST("calloc (swap)", (void *) 0, calloc, 1, page);
+  header[256] = 1;
+  header[257] = size / page - 1;
+  memcpy((char *) header + page - 10, "SWAPSPACE2", 10);
+  MUST("pwrite swap", -1, pwrite, fd, header, page, 0);
+  free(header);
+  close(fd);
+
+  MUST("swapon", -1, swapon, dev, 0);
+}
+
+static void handle_mount(const Mount *mnt, size_t index) {
   char target[sizeof "/host/" + strlen(mnt->target)];
-  snprintf(target, sizeof target, "/host%s%s", *mnt->target == '/' ? "" : "/", mnt->target);
+  mount_target(mnt, target, sizeof target);
 
   printf("umlbox mount: %s\n", target);
 
@@ -186,16 +731,209 @@ static void handle_mount(const Mount *mnt) {
   if (mnt->nosuid) flags |= MS_NOSUID;
 
   mkdirs(target);
-  MUST("mount", -1, mount, mnt->source, target, mnt->fstype, flags, *mnt->data ? mnt->data : NULL);
+  if (!mnt->overlay) {
+    mount_or_fallback(mnt, target, flags);
+    return;
+  }
+
+  // the mount itself goes under /overlay/<index>, outside the /host root;
+  // upper and work directories must be on the same filesystem
+  char lower[sizeof "/overlay/" + 3 * sizeof (size_t) + sizeof "/lower"];
+  char rw[sizeof lower], upper[sizeof lower + sizeof "/upper"], work[sizeof upper];
+  overlay_dir(index, "lower", lower, sizeof lower);
+  overlay_dir(index, "rw", rw, sizeof rw);
+  snprintf(upper, sizeof upper, "%s/upper", rw);
+  snprintf(work, sizeof work, "%s/work", rw);
+
+  mkdirs(lower);
+  mount_or_fallback(mnt, lower, flags | MS_RDONLY);
+  mkdirs(rw);
+  MUST("mount (upper)", -1, mount, "tmpfs", rw, "tmpfs", 0, NULL);
+  mkdirs(upper);
+  mkdirs(work);
+
+  char data[sizeof "lowerdir=,upperdir=,workdir=" + sizeof lower + sizeof upper + sizeof work];
+  snprintf(data, sizeof data, "lowerdir=%s,upperdir=%s,workdir=%s", lower, upper, work);
+  if (mount("overlay", target, "overlay", flags & ~MS_RDONLY, data) == -1) {
+    // overlayfs is only in Linux 3.18 and later; the job still gets the tree,
+    // if read-only
+    printf("umlbox overlay: %s: %s\n", target, strerror(errno));
+    MUST("mount --bind", -1, mount, lower, target, NULL, MS_BIND, NULL);
+  }
 }
 
-static bool handle_run(const Run *run) {
-  printf("umlbox run: %s\n", run->cmd);
+static void mount_or_fallback(const Mount *mnt, const char *dir, unsigned long flags) {
+  const char *data = *mnt->data ? mnt->data : NULL;
+  if (!*mnt->hostfs_fallback) {
+    MUST("mount", -1, mount, mnt->source, dir, mnt->fstype, flags, data);
+    return;
+  }
+  if (mount(mnt->source, dir, mnt->fstype, flags, data) == 0)
+    return;
 
-  sigset_t orig_mask, chld_mask;
-  sigemptyset(&chld_mask);
-  sigaddset(&chld_mask, SIGCHLD);
-  MUST("sigprocmask (block SIGCHLD)", -1, sigprocmask, SIG_BLOCK, &chld_mask, &orig_mask);
+  printf("umlbox mount: %s: %s: %s, using hostfs\n", dir, mnt->fstype, strerror(errno));
+  MUST("mount (hostfs)", -1, mount, "none", dir, "hostfs", flags, mnt->hostfs_fallback);
+}
+
+static void mount_target(const Mount *mnt, char *target, size_t size) {
+  snprintf(target, size, "/host%s%s", *mnt->target == '/' ? "" : "/", mnt->target);
+}
+
+static void overlay_dir(size_t index, const char *part, char *dir, size_t size) {
+  snprintf(dir, size, "/overlay/%zu/%s", index, part);
+}
+
+// starts a group of runs, and supervises them until the non-daemons have
+// finished and their output has been passed on; returns true if the job
+// timed out
+static bool run_group(Run *const *runs, size_t first, size_t n, int status_fd) {
+  struct member *members = MUST("calloc (group)", (void *) 0, calloc, n, sizeof *members);
+  size_t n_members = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    const Run *run = runs[i];
+    int relay_in;
+    if (run->daemon) {
+      start_run(run, 0, &relay_in);
+      continue;
+    }
+
+    struct member *m = &members[n_members++];
+    m->run = run;
+    run_result__init(&m->result);
+    m->result.index = first + i;
+    m->result.started_us = monotonic_us();
+    if (run->timeout_ms)
+      m->deadline_us = m->result.started_us + run->timeout_ms * 1000ull;
+    m->pid = start_run(run, &m->truncated, &m->relay_in);
+  }
+
+  bool timed_out = false;
+  struct pollfd fds[2 + MAX_RELAYS + MAX_FEEDS];
+
+  while (true) {
+    reap_members(members, n_members);
+
+    size_t pending = 0;
+    for (size_t i = 0; i < n_members; i++) {
+      struct member *m = &members[i];
+      if (m->reported)
+        continue;
+      if (m->pid || relay_open(m->relay_in))
+        pending++;
+      else
+        report_member(status_fd, m);
+    }
+    if (!pending)
+      break;
+
+    uint64_t now = monotonic_us(), next = 0;
+    for (size_t i = 0; i < n_members; i++) {
+      struct member *m = &members[i];
+      if (!m->pid || !m->deadline_us)
+        continue;
+      if (m->deadline_us <= now) {
+        printf("umlbox: %s timed out, killing process group %d\n", m->run->cmd, (int) m->pid);
+        m->result.timed_out = true;
+        m->deadline_us = 0;
+        kill_group(m->pid, m->run->kill_grace_ms);
+      } else if (!next || m->deadline_us < next) {
+        next = m->deadline_us;
+      }
+    }
+    uint64_t next_kill = kill_due(now);
+    if (next_kill && (!next || next_kill < next))
+      next = next_kill;
+
+    struct timespec wait = { (next - now) / 1000000, (next - now) % 1000000 * 1000 };
+
+    fds[0] = (struct pollfd) { .fd = 0, .events = POLLIN };
+    fds[1] = (struct pollfd) { .fd = sigchld_fd, .events = POLLIN };
+    size_t n_polled = n_relays;
+    for (size_t i = 0; i < n_relays; i++)
+      fds[2 + i] = (struct pollfd) { .fd = relays[i].in, .events = POLLIN };
+    for (size_t i = 0; i < n_feeds; i++)
+      fds[2 + n_polled + i] = (struct pollfd) { .fd = feeds[i].out, .events = POLLOUT };
+
+    int ret = ppoll(fds, 2 + n_polled + n_feeds, next ? &wait : 0, 0);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1)
+      fail("poll (group)");
+
+    if (fds[1].revents) {
+      struct signalfd_siginfo info;
+      while (read(sigchld_fd, &info, sizeof info) > 0)
+        ;
+    }
+    // backwards, as a finished relay or feed is replaced by the last one
+    for (size_t i = n_feeds; i > 0; i--)
+      if (fds[1 + n_polled + i].revents)
+        feed_pump(i - 1);
+    for (size_t i = n_polled; i > 0; i--)
+      if (fds[1 + i].revents)
+        relay_pump(i - 1);
+    if (!fds[0].revents)
+      continue;
+
+    unsigned char hard_timeout[2];
+    MUST("read (timeout signal)", -1, read, 0, hard_timeout, 2);
+    timed_out = true;
+    for (size_t i = 0; i < n_members; i++)
+      members[i].result.timed_out = true;
+    if (*hard_timeout == 'Y')
+      break;
+    for (size_t i = 0; i < n_members; i++)
+      if (members[i].pid)
+        MUST("kill", -1, kill, members[i].pid, SIGTERM);
+  }
+
+  // after a hard timeout, what hasn't finished is reported as it is, and
+  // relays still going must forget about it
+  for (size_t i = 0; i < n_members; i++) {
+    if (!members[i].reported)
+      report_member(status_fd, &members[i]);
+    for (size_t j = 0; j < n_relays; j++)
+      if (relays[j].truncated == &members[i].truncated)
+        relays[j].truncated = 0;
+  }
+  free(members);
+  return timed_out;
+}
+
+static void reap_members(struct member *members, size_t n) {
+  int waited_status;
+  struct rusage usage;
+  pid_t waited;
+  while ((waited = wait4(-1, &waited_status, WNOHANG, &usage)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      struct member *m = &members[i];
+      if (m->pid != waited)
+        continue;
+      m->pid = 0;
+      if (WIFEXITED(waited_status))
+        m->result.exit_code = WEXITSTATUS(waited_status);
+      if (WIFSIGNALED(waited_status))
+        m->result.signal = WTERMSIG(waited_status);
+      m->result.wall_us = monotonic_us() - m->result.started_us;
+      m->result.user_us = usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+      m->result.sys_us = usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+      m->result.max_rss_kb = usage.ru_maxrss;
+    }
+  }
+  if (waited == -1 && errno != ECHILD)
+    fail("wait");
+}
+
+static void report_member(int status_fd, struct member *m) {
+  m->result.truncated = m->truncated;
+  m->reported = true;
+  if (status_fd != -1)
+    report_run(status_fd, &m->result);
+}
+
+static pid_t start_run(const Run *run, bool *truncated, int *relay_in) {
+  printf("umlbox run: %s\n", run->cmd);
 
   uid_t uid = run->uid;
   gid_t gid = run->gid;
@@ -204,152 +942,358 @@ static bool handle_run(const Run *run) {
     if (gid == 0) gid = random() % 995000 + 5000;
   }
 
-  pid_t cat = -1;
-  int cat_pipe[2];
-  if (run->cat_output) {
-    MUST("pipe (cat)", -1, pipe, cat_pipe);
+  int out_flags = O_WRONLY | (run->create_output ? O_CREAT | O_TRUNC : 0);
+
+  // with cat_output, the command writes to a pipe that init relays to the
+  // output device, so the command doesn't think it's writing to a terminal;
+  // output caps are enforced on the same path
+  bool relay = run->cat_output || run->max_output_bytes || run->max_output_lines;
+  int cat_pipe[2] = {-1, -1};
+  if (relay) {
+    if (n_relays == MAX_RELAYS)
+      errno = EMFILE, fail("too many output relays");
+    MUST("pipe (cat)", -1, pipe2, cat_pipe, O_CLOEXEC);
+  }
 
-    cat = MUST("fork", -1, fork);
-    if (cat == 0) {
-      in_init = 0;
+  // with input_length, init feeds the command exactly that much of its input
+  // through a pipe, e.g. from a block device holding a file
+  int feed_pipe[2] = {-1, -1};
+  if (run->input_length) {
+    if (n_feeds == MAX_FEEDS)
+      errno = EMFILE, fail("too many input feeds");
+    MUST("pipe (feed)", -1, pipe2, feed_pipe, O_CLOEXEC);
+    feeds[n_feeds].in = MUST("open (feed)", -1, open, *run->input ? run->input : "/null", O_RDONLY | O_CLOEXEC);
+    feeds[n_feeds].out = feed_pipe[1];
+    feeds[n_feeds].left = run->input_length;
+    MUST("fcntl (feed)", -1, fcntl, feed_pipe[1], F_SETFL, O_NONBLOCK);
+    n_feeds++;
+  }
 
-      MUST("dup2 (cat -> in)", -1, dup2, cat_pipe[0], 0);
-      open_to(1, *run->output ? run->output : "/null", O_WRONLY, -1);
-      open_to(2, *run->error ? run->error : 0, O_WRONLY, 1);
-      if (cat_pipe[0] > 2) close(cat_pipe[0]);
-      if (cat_pipe[1] > 2) close(cat_pipe[1]);
+  // fork would copy init's whole address space through the host; with
+  // CLONE_VFORK, init instead waits until the child has exec'd or given up
+  struct spawn sp = {
+    .run = run,
+    .uid = uid,
+    .gid = gid,
+    .out_flags = out_flags,
+    .relay_fd = cat_pipe[1],
+    .feed_fd = feed_pipe[0],
+  };
+  spawn_prepare(&sp);
+  pid_t child = MUST("clone", -1, clone, spawn_child, spawn_stack + sizeof spawn_stack,
+                     CLONE_VM | CLONE_VFORK | SIGCHLD, &sp);
+  if (sp.failed)
+    printf("umlbox run: %s: %s: %s\n", run->cmd, sp.failed, strerror(sp.error));
+  spawn_free(&sp);
+  if (feed_pipe[0] != -1)
+    close(feed_pipe[0]);
+
+  // the relay belongs to init rather than the run, so that it keeps going
+  // for daemons while later runs execute
+  if (relay) {
+    close(cat_pipe[1]);
+    int out = MUST("open (cat)", -1, open, *run->output ? run->output : "/null", out_flags | O_CLOEXEC, 0666);
+    relay_add(cat_pipe[0], out, run, child, truncated);
+  }
+  *relay_in = cat_pipe[0];
+  return child;
+}
 
-      hostify(run->cwd, run->user, uid, gid);
+static void spawn_prepare(struct spawn *sp) {
+  const Run *run = sp->run;
+
+  sp->argv = MUST("malloc argv", (void *) 0, malloc, (run->n_arg + 3) * sizeof *sp->argv);
+  sp->argv[0] = DEFAULT_SHELL;
+  sp->argv[1] = run->cmd;
+  for (size_t i = 0; i < run->n_arg; i++)
+    sp->argv[2 + i] = run->arg[i];
+  sp->argv[2 + run->n_arg] = 0;
+
+  // init's environment, with the run's variables added or replaced
+  size_t n = 0, strings_len = 1;
+  while (environ[n])
+    n++;
+  for (size_t i = 0; i < run->n_env; i++)
+    strings_len += strlen(run->env[i]->key) + strlen(run->env[i]->value) + 2;
+  sp->envp = MUST("malloc envp", (void *) 0, malloc, (n + run->n_env + 1) * sizeof *sp->envp);
+  sp->env_strings = MUST("malloc env", (void *) 0, malloc, strings_len);
+  memcpy(sp->envp, environ, n * sizeof *sp->envp);
+
+  char *at = sp->env_strings;
+  for (size_t i = 0; i < run->n_env; i++) {
+    size_t key_len = strlen(run->env[i]->key);
+    char *var = at;
+    at += sprintf(at, "%s=%s", run->env[i]->key, run->env[i]->value) + 1;
+    size_t j = 0;
+    while (j < n && strncmp(sp->envp[j], var, key_len + 1) != 0)
+      j++;
+    sp->envp[j] = var;
+    if (j == n)
+      n++;
+  }
+  sp->envp[n] = 0;
+
+  sp->path = 0;
+  sp->cmd_buf = 0;
+  if (strchr(run->cmd, '/') == 0) {
+    sp->path = DEFAULT_PATH;
+    for (size_t j = 0; j < n; j++)
+      if (strncmp(sp->envp[j], "PATH=", 5) == 0)
+        sp->path = sp->envp[j] + 5;
+    sp->cmd_buf = MUST("malloc (cmd)", (void *) 0, malloc, strlen(sp->path) + strlen(run->cmd) + 2);
+  }
+}
 
-      char *argv[2] = {"cat", NULL};
-      MUST("execvp", -1, execvp, "cat", argv);
-      exit(0);
-    }
+static int spawn_child(void *arg) {
+  struct spawn *sp = arg;
+  const Run *run = sp->run;
+
+  setpgid(0, 0);
+
+  if (sp->feed_fd != -1)
+    CHILD_MUST(sp, "dup2 (feed -> in)", -1, dup2, sp->feed_fd, 0);
+  else
+    spawn_open(sp, 0, *run->input ? run->input : "/null", O_RDONLY, -1);
+  if (sp->relay_fd != -1) {
+    CHILD_MUST(sp, "dup2 (cat -> out)", -1, dup2, sp->relay_fd, 1);
+    CHILD_MUST(sp, "dup2 (cat -> err)", -1, dup2, sp->relay_fd, 2);
+  } else {
+    spawn_open(sp, 1, *run->output ? run->output : "/null", sp->out_flags, -1);
+    spawn_open(sp, 2, *run->error ? run->error : 0, sp->out_flags, 1);
   }
 
-  pid_t child = MUST("fork", -1, fork);
-  if (child == 0) {
-    in_init = 0;
+  hostify(sp);
+  set_limits(sp);
+  CHILD_MUST(sp, "sigprocmask", -1, sigprocmask, SIG_SETMASK, &run_mask, 0);
 
-    open_to(0, *run->input ? run->input : "/null", O_RDONLY, -1);
-    if (cat != -1) {
-      if (cat_pipe[1] != 1) MUST("dup2 (cat -> out)", -1, dup2, cat_pipe[1], 1);
-      if (cat_pipe[1] != 2) MUST("dup2 (cat -> err)", -1, dup2, cat_pipe[1], 2);
-      if (cat_pipe[0] > 2) close(cat_pipe[0]);
-      if (cat_pipe[1] > 2) close(cat_pipe[1]);
-    } else {
-      open_to(1, *run->output ? run->output : "/null", O_WRONLY, -1);
-      open_to(2, *run->error ? run->error : 0, O_WRONLY, 1);
+  char **argv = sp->argv;
+  char *cmd = sp->path ? sp->cmd_buf : run->cmd;
+  const char *path = sp->path;
+  int exec_errno = 0;
+  do {
+    if (path) {
+      char *colon = strchr(path, ':');
+      if (colon) {
+        sprintf(cmd, "%.*s/%s", (int) (colon - path), path, run->cmd);
+        path = colon + 1;
+      } else {
+        sprintf(cmd, "%s/%s", path, run->cmd);
+        path += strlen(path);
+      }
     }
+    execve(cmd, argv + 1, sp->envp);
+    if (errno == ENOEXEC) {
+      argv[1] = cmd;
+      execve(DEFAULT_SHELL, argv, sp->envp);
+      if (exec_errno != EACCES) exec_errno = errno;
+      break;
+    }
+    if (exec_errno != EACCES) exec_errno = errno;
+  } while (path && *path);
+  dprintf(2, "%s? %s\n", run->cmd, strerror(exec_errno));
+  _exit(1);
+}
+
+static void spawn_fail(struct spawn *sp, const char *msg) {
+  sp->failed = msg;
+  sp->error = errno;
+  _exit(1);
+}
+
+static void spawn_open(struct spawn *sp, int new_fd, const char *path, int flags, int fallback_fd) {
+  int fd = fallback_fd;
+  bool do_open = path && *path;
+  if (do_open) fd = CHILD_MUST(sp, "open", -1, open, path, flags, 0666);
+  if (fd != -1 && fd != new_fd) {
+    CHILD_MUST(sp, "dup2", -1, dup2, fd, new_fd);
+    if (do_open) close(fd);
+  }
+}
+
+static void spawn_free(struct spawn *sp) {
+  free(sp->argv);
+  free(sp->envp);
+  free(sp->env_strings);
+  free(sp->cmd_buf);
+}
+
+static void mark_phase(const char *name) {
+  if (n_phases == MAX_PHASES)
+    return;
+  Phase *phase = &phase_buf[n_phases];
+  phase__init(phase);
+  phase->name = (char *) name;
+  phase->at_us = monotonic_us();
+  phases[n_phases++] = phase;
+}
+
+static uint64_t monotonic_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void relay_add(int in, int out, const Run *run, pid_t group, bool *truncated) {
+  relays[n_relays].in = in;
+  relays[n_relays].out = out;
+  relays[n_relays].bytes_left = run->max_output_bytes ? run->max_output_bytes : NO_CAP;
+  relays[n_relays].lines_left = run->max_output_lines ? run->max_output_lines : NO_CAP;
+  relays[n_relays].group = group;
+  relays[n_relays].grace_ms = run->kill_grace_ms;
+  relays[n_relays].truncated = truncated;
+  n_relays++;
+}
 
-    for (size_t i = 0; i < run->n_env; i++)
-      setenv(run->env[i]->key, run->env[i]->value, /* overwrite= */ 1);
-
-    hostify(run->cwd, run->user, uid, gid);
-    set_limits(run->n_limit, run->limit);
-
-    char **argv = MUST("malloc argv", (void *) 0, malloc, (run->n_arg + 3) * sizeof *argv);
-    argv[0] = DEFAULT_SHELL;
-    argv[1] = run->cmd;
-    for (size_t i = 0; i < run->n_arg; i++)
-      argv[2 + i] = run->arg[i];
-    argv[2 + run->n_arg] = 0;
-
-    char *cmd = run->cmd;
-    char *path = 0;
-    if (strchr(cmd, '/') == 0) {
-      path = getenv("PATH");
-      if (!path) path = DEFAULT_PATH;
-      cmd = MUST("malloc (cmd)", (void *) 0, malloc, strlen(path) + strlen(run->cmd) + 2);
+static bool relay_open(int in) {
+  for (size_t i = 0; i < n_relays; i++)
+    if (relays[i].in == in)
+      return true;
+  return false;
+}
+
+static void relay_pump(size_t i) {
+  static char buf[RELAY_CHUNK];
+  int in = relays[i].in, out = relays[i].out;
+  size_t want = relays[i].bytes_left < RELAY_CHUNK ? relays[i].bytes_left : RELAY_CHUNK;
+
+  ssize_t moved = -1;
+  if (want == 0 || relays[i].lines_left == 0) {
+    // the output is full, so anything more is too much
+    moved = read(in, buf, 1);
+    if (moved > 0) {
+      relay_overflow(i);
+      return;
     }
-    int exec_errno = 0;
-    do {
-      if (path) {
-        char *colon = strchr(path, ':');
-        if (colon) {
-          sprintf(cmd, "%.*s/%s", (int) (colon - path), path, run->cmd);
-          path = colon + 1;
-        } else {
-          sprintf(cmd, "%s/%s", path, run->cmd);
-          path += strlen(path);
+  } else {
+    errno = EINVAL;
+    if (relays[i].lines_left == NO_CAP)
+      moved = splice(in, 0, out, 0, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    // counting lines, or not every output device can be spliced to
+    if (moved == -1 && errno == EINVAL) {
+      moved = read(in, buf, want);
+      if (moved > 0) {
+        size_t keep = relay_lines(i, buf, moved);
+        if (writeall(out, buf, keep) == -1) {
+          moved = -1;
+        } else if (keep < (size_t) moved) {
+          relays[i].bytes_left -= keep;
+          relay_overflow(i);
+          return;
         }
       }
-      execv(cmd, argv + 1);
-      if (errno == ENOEXEC) {
-        argv[1] = cmd;
-        execv(DEFAULT_SHELL, argv);
-        if (exec_errno != EACCES) exec_errno = errno;
-        break;
-      }
-      if (exec_errno != EACCES) exec_errno = errno;
-    } while (path && *path);
-    printf("%s? %s\n", run->cmd, strerror(exec_errno));
-    exit(1);
+    }
+    if (moved > 0 && relays[i].bytes_left != NO_CAP)
+      relays[i].bytes_left -= moved;
   }
+  if (moved > 0 || (moved == -1 && (errno == EAGAIN || errno == EINTR)))
+    return;
 
-  if (run->daemon) {
-    MUST("sigprocmask (unblock SIGCHLD)", -1, sigprocmask, SIG_SETMASK, &orig_mask, 0);
-    return false;
-  }
+  // end of output, or nowhere to put it
+  close(in);
+  close(out);
+  relays[i] = relays[--n_relays];
+}
 
-  if (cat != -1) {
-    close(cat_pipe[0]);
-    close(cat_pipe[1]);
+// returns how much of buf fits in the relay's line cap, and uses it up
+static size_t relay_lines(size_t i, const char *buf, size_t len) {
+  if (relays[i].lines_left == NO_CAP)
+    return len;
+  for (size_t at = 0; at < len; at++) {
+    if (buf[at] == '\n' && --relays[i].lines_left == 0)
+      return at + 1;
   }
+  return len;
+}
 
-  bool timed_out = false;
-  struct pollfd timeout_fd = { .fd = 0, .events = POLLIN };
+static void relay_overflow(size_t i) {
+  printf("umlbox: output cap reached, killing process group %d\n", (int) relays[i].group);
+  if (relays[i].truncated)
+    *relays[i].truncated = true;
 
-  bool child_running = 1, cat_running = run->cat_output;
-  while (true) {
-    pid_t waited = waitpid(-1, 0, WNOHANG);
-    if (waited == -1)
-      fail("wait");
-    if (waited != 0) {
-      if (waited == child) child_running = false;
-      if (waited == cat) cat_running = false;
-      if (!child_running && !cat_running)
-        break;
-      continue;
-    }
+  kill_group(relays[i].group, relays[i].grace_ms);
 
-    int ret = ppoll(&timeout_fd, 1, 0, &orig_mask);
-    if (ret == -1 && errno == EINTR) {
-      continue;
-    }
-    if (ret == -1)
-      fail("poll (timeout signal)");
+  // the command gets EPIPE or SIGPIPE if it keeps writing
+  close(relays[i].in);
+  close(relays[i].out);
+  relays[i] = relays[--n_relays];
+}
 
-    unsigned char hard_timeout[2];
-    MUST("read (timeout signal)", -1, read, 0, hard_timeout, 2);
-    timed_out = true;
-    if (*hard_timeout == 'Y')
-      break;
-    if (child_running)
-      MUST("kill", -1, kill, child, SIGTERM);
+static void relay_drain(void) {
+  while (n_relays > 0)
+    relay_pump(n_relays - 1);
+}
+
+static void feed_pump(size_t i) {
+  static char buf[PIPE_BUF];
+  int in = feeds[i].in, out = feeds[i].out;
+
+  ssize_t moved = 0;
+  if (feeds[i].left > 0) {
+    size_t want = feeds[i].left < RELAY_CHUNK ? feeds[i].left : RELAY_CHUNK;
+    moved = splice(in, 0, out, 0, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    // not every input can be spliced from; a writable pipe has room for at
+    // least PIPE_BUF bytes, which are written all at once
+    if (moved == -1 && errno == EINVAL) {
+      moved = read(in, buf, want < PIPE_BUF ? want : PIPE_BUF);
+      if (moved > 0 && write(out, buf, moved) != moved)
+        moved = -1;
+    }
+    if (moved > 0)
+      feeds[i].left -= moved;
   }
+  if ((moved > 0 && feeds[i].left > 0) || (moved == -1 && (errno == EAGAIN || errno == EINTR)))
+    return;
 
-  MUST("sigprocmask (unblock SIGCHLD)", -1, sigprocmask, SIG_SETMASK, &orig_mask, 0);
-  return timed_out;
+  // all passed on, end of input, or the command has stopped reading
+  feed_close(i);
+}
+
+static void feed_close(size_t i) {
+  close(feeds[i].in);
+  close(feeds[i].out);
+  feeds[i] = feeds[--n_feeds];
 }
 
-static void handle_sigchld(int sig, siginfo_t *info, void *ctx) {
-  // poll already interrupted by this signal, no action needed
+// SIGTERMs a process group, and SIGKILLs it grace_ms later, or right away if
+// there is no grace period (or no room to remember it)
+static void kill_group(pid_t group, uint32_t grace_ms) {
+  bool grace = grace_ms && n_kills < MAX_KILLS;
+  kill(-group, grace ? SIGTERM : SIGKILL);
+  if (grace) {
+    kills[n_kills].group = group;
+    kills[n_kills].at_us = monotonic_us() + grace_ms * 1000ull;
+    n_kills++;
+  }
+}
+
+// SIGKILLs groups whose grace period is over, and returns when the next one
+// is due, or 0 if there is none
+static uint64_t kill_due(uint64_t now) {
+  uint64_t next = 0;
+  for (size_t i = n_kills; i > 0; i--) {
+    uint64_t at = kills[i - 1].at_us;
+    if (at <= now) {
+      kill(-kills[i - 1].group, SIGKILL);
+      kills[i - 1] = kills[--n_kills];
+    } else if (!next || at < next) {
+      next = at;
+    }
+  }
+  return next;
 }
 
 // utilities
 
 static void fail(const char *msg) {
   printf("umlbox: %s: %s\n", msg, strerror(errno));
-  if (in_init)
-    reboot(LINUX_REBOOT_CMD_POWER_OFF);
+  reboot(LINUX_REBOOT_CMD_POWER_OFF);
   exit(1);
 }
 
 static void open_to(int new_fd, const char *path, int flags, int fallback_fd) {
   int fd = fallback_fd;
   bool do_open = path && *path;
-  if (do_open) fd = MUST("open", -1, open, path, flags);
+  if (do_open) fd = MUST("open", -1, open, path, flags, 0666);
   if (fd != -1 && fd != new_fd) {
     MUST("dup2", -1, dup2, fd, new_fd);
     if (do_open) close(fd);
@@ -368,7 +1312,22 @@ static ssize_t readall(int fd, void* buf, size_t count) {
       return -1;
     }
     at += chunk;
-    got -= chunk;
+    got += chunk;
+  }
+  return count;
+}
+
+static ssize_t writeall(int fd, const void *buf, size_t count) {
+  const char *at = buf;
+  size_t left = count;
+  while (left > 0) {
+    ssize_t chunk = write(fd, at, left);
+    if (chunk < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    at += chunk;
+    left -= chunk;
   }
   return count;
 }
@@ -398,18 +1357,18 @@ static void mkdirs(const char *dir) {
   MUST("chdir /", -1, chdir, "/");
 }
 
-static void hostify(const char *cwd, bool user, uid_t uid, gid_t gid) {
-  MUST("chdir root", -1, chdir, "/host");
-  MUST("chroot", -1, chroot, ".");
-  if (*cwd) MUST("chdir cwd", -1, chdir, cwd);
+static void hostify(struct spawn *sp) {
+  CHILD_MUST(sp, "chdir root", -1, chdir, "/host");
+  CHILD_MUST(sp, "chroot", -1, chroot, ".");
+  if (*sp->run->cwd) CHILD_MUST(sp, "chdir cwd", -1, chdir, sp->run->cwd);
 
-  if (user) {
-    MUST("setgid", -1, setgid, gid);
-    MUST("setuid", -1, setuid, uid);
+  if (sp->run->user) {
+    CHILD_MUST(sp, "setgid", -1, setgid, sp->gid);
+    CHILD_MUST(sp, "setuid", -1, setuid, sp->uid);
   }
 }
 
-static void set_limits(size_t n_limit, Limit **limit) {
+static void set_limits(struct spawn *sp) {
   static const struct {
     bool valid;
     int resource;
@@ -427,13 +1386,13 @@ static void set_limits(size_t n_limit, Limit **limit) {
   static const int n_resource_map = sizeof resource_map / sizeof *resource_map;
 
   struct rlimit rlim;
-  for (size_t i = 0; i < n_limit; i++) {
-    Limit *l = limit[i];
+  for (size_t i = 0; i < sp->run->n_limit; i++) {
+    Limit *l = sp->run->limit[i];
     if (l->resource < 0 || l->resource >= n_resource_map || !resource_map[l->resource].valid)
-      errno = EINVAL, fail("set_limits");
+      errno = EINVAL, spawn_fail(sp, "set_limits");
     rlim.rlim_cur = l->soft >= 0 ? l->soft : RLIM_INFINITY;
     rlim.rlim_max = l->hard >= 0 ? l->hard : RLIM_INFINITY;
-    MUST("setrlimit", -1, setrlimit, resource_map[l->resource].resource, &rlim);
+    CHILD_MUST(sp, "setrlimit", -1, setrlimit, resource_map[l->resource].resource, &rlim);
   }
 }
 
@@ -450,4 +1409,9 @@ static void dump_config(uint32_t len, const Config *cfg) {
 
   for (size_t i = 0; i < cfg->n_run; i++)
     printf("- run: %s\n", cfg->run[i]->cmd);
+  for (size_t i = 0; i < cfg->n_interface; i++)
+    printf("- interface: %s\n", cfg->interface[i]->name);
+
+  if (*cfg->status)
+    printf("- status: %s\n", cfg->status);
 }
@@ -25,32 +25,63 @@
 #include <unistd.h>
 
 #include "muxsocket.h"
+#include "muxthread.h"
 
 #include "genfd.h"
 #include "tcp4.h"
+#include "trace.h"
 #include "unix.h"
 
-void mapSet(struct Buffer_int *buf, int from, int to)
+static void usage()
 {
-    while (buf->bufsz <= from) EXPAND_BUFFER(*buf);
-    for (; buf->bufused <= from; buf->bufused++)
-        buf->buf[buf->bufused] = -1;
-    buf->buf[from] = to;
+    fprintf(stderr, "Use: umlbox-mudem [-t threads] [-T trace-file | -R] [-s sample] {0|1} [sockets...]\n");
+    exit(1);
 }
 
 int main(int argc, char **argv)
 {
-    int preferredId, i, tmpi;
-    struct Buffer_int readMap, writeMap; /* maps of fd -> id */
+    int preferredId, threads, traceReport, traceSample, i, tmpi;
+    const char *traceFile;
     fd_set readfds, writefds;
-    int nfds, nsocks, r, w;
-    Socket *sock;
+    struct timeval traceWait;
+    Socket **configured;
     char ocbuf;
 
-    if (argc < 2 || !argv[1][0] || argv[1][1]) {
-        fprintf(stderr, "Use: umlbox-mudem {0|1} [sockets...]\n");
-        return 1;
+    threads = 0;
+    traceFile = NULL;
+    traceReport = 0;
+    traceSample = 16;
+    while ((tmpi = getopt(argc, argv, "t:T:Rs:")) != -1) {
+        switch (tmpi) {
+            case 't':
+                /* N worker threads behind a dedicated link thread */
+                threads = atoi(optarg);
+                break;
+
+            case 'T':
+                /* collect latency samples into a trace file */
+                traceFile = optarg;
+                break;
+
+            case 'R':
+                /* report latency samples to the other side */
+                traceReport = 1;
+                break;
+
+            case 's':
+                /* sample one in this many sends */
+                traceSample = atoi(optarg);
+                break;
+
+            default:
+                usage();
+        }
     }
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    if (argc < 2 || !argv[1][0] || argv[1][1] || threads < 0 || traceSample < 1)
+        usage();
 
     preferredId = atoi(argv[1]);
 
@@ -59,6 +90,8 @@ int main(int argc, char **argv)
     initGenFD();
     initTCP4();
     initUNIX();
+    if (traceFile || traceReport)
+        initTrace(traceFile, traceReport, traceSample, preferredId, argc);
 
     /* perform our handshake (A->B->C) */
     if (preferredId == 1) {
@@ -105,6 +138,7 @@ int main(int argc, char **argv)
     }
 
     /* now create every socket */
+    SF(configured, calloc, NULL, (argc, sizeof(Socket *)));
     for (i = 2; i < argc; i++) {
         Socket *sock;
         char *arg;
@@ -116,58 +150,23 @@ int main(int argc, char **argv)
             fprintf(stderr, "Invalid socket %s.\n", argv[i]);
             exit(1);
         }
+        traceNameChannel(i, argv[i]);
 
-        registerSocket(sock, &i);
+        if (threads > 0) {
+            /* the workers register these themselves */
+            configured[i] = sock;
+        } else {
+            registerSocket(sock, &i);
+        }
     }
 
-    INIT_BUFFER(readMap);
-    INIT_BUFFER(writeMap);
+    if (threads > 0)
+        muxThreadRun(threads, configured, argc);
 
     /* and go into our select loop */
     while (1) {
-        readMap.bufused = 0;
-        writeMap.bufused = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        nfds = 0;
-        nsocks = socketCount();
-
-        /* detect every socket */
-        for (i = 0; i < nsocks; i++) {
-            sock = socketById(i);
-            if (sock && sock->vtbl->shouldSelect) {
-                sock->vtbl->shouldSelect(sock, &r, &w);
-                if (r >= 0) {
-                    mapSet(&readMap, r, i);
-                    if (r >= nfds) nfds = r + 1;
-                    FD_SET(r, &readfds);
-                }
-                if (w >= 0) {
-                    mapSet(&writeMap, w, i);
-                    if (w >= nfds) nfds = w + 1;
-                    FD_SET(w, &writefds);
-                }
-            }
-        }
-
-        /* then select them */
-        SF(tmpi, select, -1, (nfds, &readfds, &writefds, NULL, NULL));
-
-        /* now perform actions */
-        for (i = 0; i < nfds; i++) {
-            if (FD_ISSET(i, &readfds)) {
-                sock = socketById(readMap.buf[i]);
-                if (sock && sock->vtbl->selectedR(sock, i) != 0) {
-                    freeSocket(sock);
-                }
-            }
-            if (FD_ISSET(i, &writefds)) {
-                sock = socketById(writeMap.buf[i]);
-                if (sock && sock->vtbl->selectedW(sock, i) != 0) {
-                    freeSocket(sock);
-                }
-            }
-        }
+        socketSelectOnce(traceTimeout(&traceWait));
+        traceTick();
     }
 
     return 0;
@@ -16,32 +16,46 @@
 
 #define _POSIX_SOURCE /* for strtok_r */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "muxsocket.h"
 #include "muxstdio.h"
+#include "muxthread.h"
+#include "trace.h"
 
 /* NULL vtbl */
 static SocketVTbl nullVTbl = {
     NULL, NULL, NULL, NULL, NULL, NULL
 };
 
-/* array of all current sockets */
-static struct Buffer_Socket sockets;
+/* placeholder for IDs we've closed, until the other side acknowledges it */
+static Socket closingSocket;
+
+/* array of all current sockets (one per thread in threaded mode) */
+static __thread struct Buffer_Socket sockets;
 
 /* and nameables */
 static NameableSocket *nameableSockets;
 
 /* and major sockets */
-Socket *stdinSocket, *stdoutSocket;
+__thread Socket *stdinSocket, *stdoutSocket;
 
 /* preferred ID offset */
 static int socketPreferredId;
 
+/* which shard of the ID space this thread allocates from, and out of how many */
+static __thread int socketShard, socketShards = 1;
+
+/* maps of fd -> id for the select loop */
+static __thread struct Buffer_int readMap, writeMap;
+
 /* base constructor for all sockets */
 Socket *newSocket(size_t sz)
 {
@@ -50,6 +64,7 @@ Socket *newSocket(size_t sz)
     ret->sz = sz;
     ret->vtbl = &nullVTbl;
     ret->id = -1;
+    ret->channel = -1;
     return ret;
 }
 
@@ -64,6 +79,8 @@ void newSocketWritable(SocketWritable *self, int fd)
 
     self->fd = fd;
     INIT_BUFFER(self->wbuf);
+    self->trace = NULL;
+    self->traceAt = 0;
 }
 
 /* generic destruct() for SocketWritable */
@@ -71,6 +88,7 @@ void socketWritableDestruct(Socket *self)
 {
     close(((SocketWritable *) self)->fd);
     FREE_BUFFER(((SocketWritable *) self)->wbuf);
+    free(((SocketWritable *) self)->trace);
 }
 
 /* generic shouldSelect() for SocketWritable */
@@ -131,6 +149,9 @@ int socketWritableSelectedW(Socket *self, int fd)
     memmove(sockw->wbuf.buf, sockw->wbuf.buf + wrote, sockw->wbuf.bufused - wrote);
     sockw->wbuf.bufused -= wrote;
 
+    if (sockw->trace)
+        traceWritten(sockw, wrote);
+
     return 0;
 }
 
@@ -146,6 +167,9 @@ void socketRead(Socket *self, const void *buf, size_t count)
 {
     unsigned char szbuf[4];
 
+    /* maybe sample it for tracing */
+    traceOutgoing(self);
+
     /* write our send command */
     muxCommand(stdoutSocket, 's', self->id);
 
@@ -155,6 +179,29 @@ void socketRead(Socket *self, const void *buf, size_t count)
     stdoutSocket->vtbl->write(stdoutSocket, buf, count);
 }
 
+/* call this when a listening socket accepts a new connection */
+void socketAccepted(Socket *listener, Socket *sock)
+{
+    int id;
+    unsigned char idbuf[4];
+
+    sock->channel = listener->id;
+
+    /* in threaded mode, the link thread picks the shard that will own it */
+    if (muxThreads > 0) {
+        muxThreadAdopt(listener, sock);
+        return;
+    }
+
+    /* register it */
+    id = registerSocket(sock, NULL);
+
+    /* then tell the other side */
+    muxCommand(stdoutSocket, 'c', listener->id);
+    muxPrepareInt(idbuf, id);
+    stdoutSocket->vtbl->write(stdoutSocket, idbuf, 4);
+}
+
 /* construct a socket by name */
 Socket *socketByName(char *namePlus)
 {
@@ -179,6 +226,7 @@ Socket *socketByName(char *namePlus)
 Socket *socketById(int id)
 {
     if (id < 0 || id >= sockets.bufused) return NULL;
+    if (sockets.buf[id] == &closingSocket) return NULL;
     return sockets.buf[id];
 }
 
@@ -204,6 +252,27 @@ void initSockets(int preferredId)
     registerSocket(stdoutSocket = newStdoutSocket(), &forceId);
 }
 
+/* initialize this thread's socket table as one shard of the ID space */
+void initSocketShard(int shard, int shards, Socket *link)
+{
+    int forceId;
+    INIT_BUFFER(sockets);
+
+    socketShard = shard;
+    socketShards = shards;
+
+    /* the link stands in for both stdin and stdout */
+    forceId = 0;
+    registerSocket(link, &forceId);
+    stdinSocket = stdoutSocket = link;
+}
+
+/* the shard which owns a given socket ID */
+int socketShardOf(int id, int shards)
+{
+    return (id / 2) % shards;
+}
+
 /* register a new socket */
 int registerSocket(Socket *socket, const int *forceId)
 {
@@ -212,8 +281,10 @@ int registerSocket(Socket *socket, const int *forceId)
     if (forceId) {
         id = *forceId;
     } else {
-        /* try to find a free ID */
-        for (id = socketPreferredId; id < sockets.bufused && sockets.buf[id]; id += 2);
+        /* try to find a free ID (IDs 0 and 1 are reserved for stdio) */
+        for (id = socketPreferredId + 2 * socketShard;
+             id < 2 || (id < sockets.bufused && sockets.buf[id]);
+             id += 2 * socketShards);
     }
 
     /* make sure we have the space */
@@ -223,7 +294,7 @@ int registerSocket(Socket *socket, const int *forceId)
     }
 
     /* kill anything that's already there */
-    if (sockets.buf[id])
+    if (sockets.buf[id] && sockets.buf[id] != &closingSocket)
         freeSocket(sockets.buf[id]);
 
     /* then take it */
@@ -236,15 +307,39 @@ int registerSocket(Socket *socket, const int *forceId)
 /* deregister and free a socket */
 void freeSocket(Socket *socket)
 {
+    int id = socket->id;
+
     /* destroy */
     if (socket->vtbl->destruct)
         socket->vtbl->destruct(socket);
-    sockets.buf[socket->id] = NULL;
+    free(socket);
+
+    /* don't reuse the ID until the other side has let go of it too, or
+     * stale data or its acknowledgement could hit a new connection */
+    sockets.buf[id] = &closingSocket;
 
     /* then tell the other side */
-    muxCommand(stdoutSocket, 'd', socket->id);
+    muxCommand(stdoutSocket, 'd', id);
+}
+
+/* call this when the other side has closed a socket */
+void socketClosed(int id)
+{
+    Socket *socket;
+
+    if (id < 0 || id >= sockets.bufused || !sockets.buf[id]) return;
+    socket = sockets.buf[id];
+
+    /* if we closed it first, this was just the acknowledgement */
+    sockets.buf[id] = NULL;
+    if (socket == &closingSocket) return;
 
+    if (socket->vtbl->destruct)
+        socket->vtbl->destruct(socket);
     free(socket);
+
+    /* acknowledge it */
+    muxCommand(stdoutSocket, 'd', id);
 }
 
 /* register a nameable socket */
@@ -253,3 +348,75 @@ void registerNameableSocket(NameableSocket *ns)
     ns->next = nameableSockets;
     nameableSockets = ns;
 }
+
+/* set an fd -> id mapping */
+static void mapSet(struct Buffer_int *buf, int from, int to)
+{
+    while (buf->bufsz <= from) EXPAND_BUFFER(*buf);
+    for (; buf->bufused <= from; buf->bufused++)
+        buf->buf[buf->bufused] = -1;
+    buf->buf[from] = to;
+}
+
+/* select over every socket once and dispatch whatever is ready */
+void socketSelectOnce(struct timeval *timeout)
+{
+    fd_set readfds, writefds;
+    int nfds, nsocks, i, r, w, tmpi;
+    Socket *sock;
+
+    if (!readMap.buf) {
+        INIT_BUFFER(readMap);
+        INIT_BUFFER(writeMap);
+    }
+
+    readMap.bufused = 0;
+    writeMap.bufused = 0;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    nfds = 0;
+    nsocks = socketCount();
+
+    /* detect every socket */
+    for (i = 0; i < nsocks; i++) {
+        sock = socketById(i);
+        if (sock && sock->vtbl->shouldSelect) {
+            sock->vtbl->shouldSelect(sock, &r, &w);
+            if (r >= 0) {
+                mapSet(&readMap, r, i);
+                if (r >= nfds) nfds = r + 1;
+                FD_SET(r, &readfds);
+            }
+            if (w >= 0) {
+                mapSet(&writeMap, w, i);
+                if (w >= nfds) nfds = w + 1;
+                FD_SET(w, &writefds);
+            }
+        }
+    }
+
+    /* then select them */
+    tmpi = select(nfds, &readfds, &writefds, NULL, timeout);
+    if (tmpi < 0) {
+        /* a signal for someone else to deal with */
+        if (errno == EINTR) return;
+        perror("select");
+        exit(1);
+    }
+
+    /* now perform actions */
+    for (i = 0; i < nfds; i++) {
+        if (FD_ISSET(i, &readfds)) {
+            sock = socketById(readMap.buf[i]);
+            if (sock && sock->vtbl->selectedR(sock, i) != 0) {
+                freeSocket(sock);
+            }
+        }
+        if (FD_ISSET(i, &writefds)) {
+            sock = socketById(writeMap.buf[i]);
+            if (sock && sock->vtbl->selectedW(sock, i) != 0) {
+                freeSocket(sock);
+            }
+        }
+    }
+}
@@ -17,6 +17,7 @@
 #ifndef MUXSOCKET_H
 #define MUXSOCKET_H
 
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "buffer.h"
@@ -25,6 +26,7 @@ typedef struct _SocketVTbl SocketVTbl;
 typedef struct _Socket Socket;
 typedef struct _SocketWritable SocketWritable;
 typedef struct _NameableSocket NameableSocket;
+typedef struct _TraceSample TraceSample;
 
 BUFFER(Socket, Socket *);
 
@@ -56,6 +58,7 @@ struct _Socket {
     size_t sz;
     SocketVTbl *vtbl;
     int id;
+    int channel; /* ID of the configured socket this came from, or -1 */
 };
 
 /* base type for buffered writable sockets */
@@ -63,6 +66,8 @@ struct _SocketWritable {
     Socket ssuper;
     int fd;
     struct Buffer_char wbuf;
+    TraceSample *trace; /* sampled data in wbuf, if any */
+    size_t traceAt; /* where in wbuf the sampled data ends */
 };
 
 /* a nameable socket type, for arg-specified sockets */
@@ -99,6 +104,9 @@ void socketWritableWrite(Socket *self, const void *buf, size_t count);
 /* call this when a socket receives data */
 void socketRead(Socket *self, const void *buf, size_t count);
 
+/* call this when a listening socket accepts a new connection */
+void socketAccepted(Socket *listener, Socket *sock);
+
 /* construct a socket by name */
 Socket *socketByName(char *name);
 
@@ -111,16 +119,28 @@ int socketCount();
 /* initialize the socket subsystem */
 void initSockets(int preferredId);
 
+/* initialize this thread's socket table as one shard of the ID space */
+void initSocketShard(int shard, int shards, Socket *link);
+
+/* the shard which owns a given socket ID */
+int socketShardOf(int id, int shards);
+
 /* register a new socket */
 int registerSocket(Socket *socket, const int *forceId);
 
 /* deregister and free a socket */
 void freeSocket(Socket *socket);
 
+/* call this when the other side has closed a socket */
+void socketClosed(int id);
+
 /* register a nameable socket */
 void registerNameableSocket(NameableSocket *ns);
 
-/* major sockets */
-extern Socket *stdinSocket, *stdoutSocket;
+/* select over every socket once and dispatch whatever is ready */
+void socketSelectOnce(struct timeval *timeout);
+
+/* major sockets (per thread) */
+extern __thread Socket *stdinSocket, *stdoutSocket;
 
 #endif
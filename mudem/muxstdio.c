@@ -16,8 +16,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "muxstdio.h"
+#include "trace.h"
 
 /* put an int into a char[4] */
 void muxPrepareInt(unsigned char *buf, int32_t i)
@@ -28,6 +30,56 @@ void muxPrepareInt(unsigned char *buf, int32_t i)
     buf[3] = i & 0xFF;
 }
 
+/* get an int out of a char[4] */
+int32_t muxReadInt(const unsigned char *buf)
+{
+    return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+           ((uint32_t) buf[2] << 8) | (uint32_t) buf[3];
+}
+
+/* put a 64-bit int into a char[8] */
+void muxPrepareInt64(unsigned char *buf, int64_t i)
+{
+    muxPrepareInt(buf, (int32_t) (i >> 32));
+    muxPrepareInt(buf + 4, (int32_t) i);
+}
+
+/* get a 64-bit int out of a char[8] */
+int64_t muxReadInt64(const unsigned char *buf)
+{
+    return (int64_t) (((uint64_t) (uint32_t) muxReadInt(buf) << 32) | (uint32_t) muxReadInt(buf + 4));
+}
+
+/* the header size of a command */
+size_t muxHeaderLength(unsigned char command)
+{
+    switch (command) {
+        case 'c': return MUX_HEADER_C;
+        case 'd': return MUX_HEADER_D;
+        case 's': return MUX_HEADER_S;
+        case 't': return MUX_HEADER_T;
+        case 'p': return MUX_HEADER_PING;
+        case 'P': return MUX_HEADER_PONG;
+        case 'r': return MUX_HEADER_R;
+        default: return 0;
+    }
+}
+
+/* the size of the complete frame at buf */
+size_t muxFrameLength(const unsigned char *buf, size_t avail)
+{
+    size_t hlen, len;
+
+    if (avail < 1) return 0;
+    hlen = muxHeaderLength(buf[0]);
+    if (hlen == 0) return (size_t) -1;
+    if (avail < hlen) return 0;
+
+    len = hlen;
+    if (buf[0] == 's') len += (size_t) muxReadInt(buf + 5);
+    return avail >= len ? len : 0;
+}
+
 /* helpers */
 void muxCommand(Socket *sock, char command, int32_t i)
 {
@@ -53,22 +105,6 @@ static ssize_t readAll(int fd, void *buf, size_t count)
     return rd;
 }
 
-static int32_t getint()
-{
-    int32_t val;
-    unsigned char c;
-    int i;
-
-    val = 0;
-    for (i = 0; i < 4; i++) {
-        val <<= 8;
-        readAll(0, &c, 1);
-        val |= c;
-    }
-
-    return val;
-}
-
 /* vtbl for stdin: */
 static void stdinShouldSelect(Socket *self, int *r, int *w);
 static int stdinSelectedR(Socket *self, int fd);
@@ -78,9 +114,11 @@ static SocketVTbl stdinVTbl = {
 };
 
 /* vtbl for stdout: */
+static int stdoutSelectedW(Socket *self, int fd);
+
 static SocketVTbl stdoutVTbl = {
     socketWritableDestruct, NULL, socketWritableShouldSelect, NULL,
-    socketWritableSelectedW, socketWritableWrite
+    stdoutSelectedW, socketWritableWrite
 };
 
 /* stdin */
@@ -99,66 +137,107 @@ static void stdinShouldSelect(Socket *self, int *r, int *w)
 
 static int stdinSelectedR(Socket *self, int fd)
 {
-    char command;
+    unsigned char header[MUX_MAX_HEADER];
+    size_t hlen;
     int id, cid;
     ssize_t ct;
-    Socket *sock, *csock;
     char *buf;
 
-    if (readAll(0, &command, 1) != 1) {
+    if (readAll(0, header, 1) != 1) {
         fprintf(stderr, "Critical error! Lost stdin!\n");
         return 1;
     }
-    id = getint();
+    hlen = muxHeaderLength(header[0]);
+    if (hlen == 0) {
+        fprintf(stderr, "Critical error! Unrecognized command %d!\n", (int) header[0]);
+        return 1;
+    }
+    if (readAll(0, header + 1, hlen - 1) != hlen - 1) {
+        fprintf(stderr, "Critical error! Lost stdin!\n");
+        return 1;
+    }
+    id = muxReadInt(header + 1);
+    cid = -1;
+    ct = 0;
+    buf = NULL;
+
+    switch (header[0]) {
+        case 'c':
+            cid = muxReadInt(header + 5);
+            break;
+
+        case 's':
+            ct = (size_t) muxReadInt(header + 5);
+            SF(buf, malloc, NULL, (ct));
+            /* read it in */
+            if (readAll(0, buf, ct) != ct) {
+                free(buf);
+                muxCommand(stdoutSocket, 'd', id);
+                fprintf(stderr, "Short send!\n");
+                return 0;
+            }
+            break;
+
+        case 't':
+            traceReceived(header);
+            muxDispatch('t', id, -1, header, hlen);
+            return 0;
+
+        case 'p':
+        case 'P':
+        case 'r':
+            traceLinkCommand(header);
+            return 0;
+    }
+
+    muxDispatch(header[0], id, cid, buf, ct);
+    free(buf);
+    return 0;
+}
+
+/* act on a single command received over the link */
+void muxDispatch(char command, int32_t id, int32_t cid, const void *buf, size_t ct)
+{
+    Socket *sock, *csock;
+
+    if (command == 'd') {
+        socketClosed(id);
+        return;
+    }
+
     sock = socketById(id);
-    if (sock == NULL) return 0;
+    if (sock == NULL) return;
 
     switch (command) {
         case 'c':
-            cid = getint();
             if (!sock->vtbl->connect) {
                 fprintf(stderr, "Received a connection request to unconnectable socket %d!\n", id);
-                return 0;
+                return;
             }
             csock = sock->vtbl->connect(sock);
             if (!csock) {
                 fprintf(stderr, "Failed to connect to socket %d.\n", id);
                 muxCommand(stdoutSocket, 'd', cid);
-                return 0;
+                return;
             }
+            csock->channel = id;
             registerSocket(csock, &cid);
             break;
 
-        case 'd':
-            freeSocket(sock);
-            break;
-
         case 's':
-            ct = (size_t) getint();
-            SF(buf, malloc, NULL, (ct));
-            /* read it in */
-            if (readAll(0, buf, ct) != ct) {
-                free(buf);
-                muxCommand(stdoutSocket, 'd', id);
-                fprintf(stderr, "Short send!\n");
-                return 0;
-            }
             if (!sock->vtbl->write) {
-                free(buf);
                 muxCommand(stdoutSocket, 'd', id);
                 fprintf(stderr, "Send to unwritable socket %d!\n", id);
-                return 0;
+                return;
             }
             sock->vtbl->write(sock, buf, ct);
-            free(buf);
+            traceQueued(sock);
             break;
 
-        default:
-            fprintf(stderr, "Critical error! Unrecognized command %d!\n", (int) command);
-            return 1;
+        case 't':
+            traceSampled(buf);
+            break;
     }
-
-    return 0;
 }
 
 /* stdout */
@@ -170,3 +249,27 @@ Socket *newStdoutSocket()
     ret->vtbl = &stdoutVTbl;
     return ret;
 }
+
+static int stdoutSelectedW(Socket *self, int fd)
+{
+    ssize_t wrote;
+    SocketWritable *sockw = (SocketWritable *) self;
+
+    /* write as much of the buffer as we can */
+    wrote = write(fd, sockw->wbuf.buf, sockw->wbuf.bufused);
+
+    if (wrote < 0) {
+        /* BAD! */
+        return 1;
+    }
+
+    /* let tracing see what actually went out */
+    if (traceEnabled)
+        traceLinkWrote((unsigned char *) sockw->wbuf.buf, wrote);
+
+    /* move down the remainder */
+    memmove(sockw->wbuf.buf, sockw->wbuf.buf + wrote, sockw->wbuf.bufused - wrote);
+    sockw->wbuf.bufused -= wrote;
+
+    return 0;
+}
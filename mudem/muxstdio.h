@@ -22,12 +22,41 @@
 
 #include "muxsocket.h"
 
+/* frame header sizes, from the command byte up to any payload */
+#define MUX_HEADER_C 9 /* 'c' id cid */
+#define MUX_HEADER_D 5 /* 'd' id */
+#define MUX_HEADER_S 9 /* 's' id length, then the payload */
+#define MUX_HEADER_T 29 /* 't' id seq channel read-time receive-time */
+#define MUX_HEADER_PING 13 /* 'p' seq time */
+#define MUX_HEADER_PONG 21 /* 'P' seq ping-time pong-time */
+#define MUX_HEADER_R 38 /* 'r' id seq channel half time time time */
+#define MUX_MAX_HEADER 38
+
 /* put an int into a char[4] */
 void muxPrepareInt(unsigned char *buf, int32_t i);
 
+/* get an int out of a char[4] */
+int32_t muxReadInt(const unsigned char *buf);
+
+/* put a 64-bit int into a char[8] */
+void muxPrepareInt64(unsigned char *buf, int64_t i);
+
+/* get a 64-bit int out of a char[8] */
+int64_t muxReadInt64(const unsigned char *buf);
+
+/* the header size of a command, or 0 if it's unknown */
+size_t muxHeaderLength(unsigned char command);
+
+/* the size of the complete frame at buf, 0 if it's incomplete, or -1 if the
+ * command is unknown */
+size_t muxFrameLength(const unsigned char *buf, size_t avail);
+
 /* write out a command */
 void muxCommand(Socket *sock, char command, int32_t id);
 
+/* act on a single command received over the link */
+void muxDispatch(char command, int32_t id, int32_t cid, const void *buf, size_t ct);
+
 /* create a stdin socket */
 Socket *newStdinSocket();
 
@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Threaded mode: the main thread owns the mux link (stdin/stdout), and each
+ * worker thread owns the channel sockets whose IDs fall into its shard. Frames
+ * travel between them in batches ("chunks") over single-producer
+ * single-consumer rings, one pair per worker. Every frame for a given socket
+ * ID goes through the same ring, so per-socket ordering is preserved.
+ *
+ * A consumer about to block in select() marks its ring as sleeping; a
+ * producer only writes the consumer's eventfd if it finds that mark, so a busy
+ * consumer is never woken more than once per batch.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "muxsocket.h"
+#include "muxstdio.h"
+#include "muxthread.h"
+#include "trace.h"
+
+#define MUX_RING_SIZE 256 /* in chunks; must be a power of two */
+#define MUX_CACHE_LINE 64
+#define MUX_READ_SIZE 65536
+
+/* types */
+typedef struct _MuxChunk MuxChunk;
+typedef struct _MuxRing MuxRing;
+typedef struct _MuxPort MuxPort;
+typedef struct _MuxWorker MuxWorker;
+typedef struct _SocketLink SocketLink;
+
+/* a batch of frames, or a connection changing hands */
+struct _MuxChunk {
+    MuxChunk *next; /* in the producer's backlog */
+    Socket *adopt; /* if set, this chunk carries a connection, not frames */
+    int32_t listenerId;
+    size_t len;
+    unsigned char data[];
+};
+
+/* lock-free single-producer single-consumer queue of chunks */
+struct _MuxRing {
+    _Atomic size_t head; /* written by the consumer */
+    char pad1[MUX_CACHE_LINE - sizeof(size_t)];
+    _Atomic size_t tail; /* written by the producer */
+    _Atomic int sleeping; /* consumer may be blocked in select() */
+    char pad2[MUX_CACHE_LINE - sizeof(size_t) - sizeof(int)];
+    MuxChunk *slots[MUX_RING_SIZE];
+};
+
+/* the producing end of a ring, owned by a single thread */
+struct _MuxPort {
+    MuxRing *ring;
+    int wakeFd; /* the consumer's eventfd */
+    MuxChunk *backlog, *backlogTail; /* chunks that didn't fit the ring yet */
+    struct Buffer_char pending; /* frames not yet batched into a chunk */
+};
+
+struct _MuxWorker {
+    pthread_t thread;
+    int shard;
+    int wakeFd;
+    MuxRing in, out; /* link -> worker, worker -> link */
+    MuxPort inPort; /* owned by the link thread */
+    MuxPort outPort; /* owned by the worker */
+};
+
+/* a worker's stand-in for stdin and stdout */
+struct _SocketLink {
+    Socket ssuper;
+    MuxWorker *worker;
+};
+
+int muxThreads;
+
+static MuxWorker *workers;
+static int linkWakeFd;
+static Socket **configuredSockets;
+static int nconfiguredSockets;
+
+/* the worker running on this thread (NULL on the link thread) */
+static __thread MuxWorker *thisWorker;
+
+/* vtbl for the link socket */
+static void linkShouldSelect(Socket *self, int *r, int *w);
+static int linkSelectedR(Socket *self, int fd);
+static void linkWrite(Socket *self, const void *buf, size_t count);
+
+static SocketVTbl linkVTbl = {
+    NULL, NULL, linkShouldSelect, linkSelectedR, NULL, linkWrite
+};
+
+/* ring operations */
+static int ringPush(MuxRing *ring, MuxChunk *chunk)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail - head == MUX_RING_SIZE) return 0;
+    ring->slots[tail & (MUX_RING_SIZE - 1)] = chunk;
+    atomic_store(&ring->tail, tail + 1);
+    return 1;
+}
+
+static MuxChunk *ringPop(MuxRing *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    MuxChunk *chunk;
+
+    if (head == tail) return NULL;
+    chunk = ring->slots[head & (MUX_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return chunk;
+}
+
+/* mark the consumer as about to sleep; returns true if it shouldn't */
+static int ringSleep(MuxRing *ring)
+{
+    atomic_store(&ring->sleeping, 1);
+    return atomic_load(&ring->tail) != atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+static void ringWake(MuxRing *ring)
+{
+    atomic_store_explicit(&ring->sleeping, 0, memory_order_relaxed);
+}
+
+/* port operations */
+static void initPort(MuxPort *port, MuxRing *ring, int wakeFd)
+{
+    port->ring = ring;
+    port->wakeFd = wakeFd;
+    port->backlog = port->backlogTail = NULL;
+    INIT_BUFFER(port->pending);
+}
+
+static void portQueue(MuxPort *port, MuxChunk *chunk)
+{
+    chunk->next = NULL;
+    if (port->backlogTail) port->backlogTail->next = chunk;
+    else port->backlog = chunk;
+    port->backlogTail = chunk;
+}
+
+/* turn the pending frames into a chunk at the end of the backlog */
+static void portSeal(MuxPort *port)
+{
+    MuxChunk *chunk;
+
+    if (port->pending.bufused == 0) return;
+
+    SF(chunk, malloc, NULL, (sizeof(MuxChunk) + port->pending.bufused));
+    chunk->adopt = NULL;
+    chunk->len = port->pending.bufused;
+    memcpy(chunk->data, port->pending.buf, chunk->len);
+    port->pending.bufused = 0;
+    portQueue(port, chunk);
+}
+
+static void portAdopt(MuxPort *port, Socket *sock, int32_t listenerId)
+{
+    MuxChunk *chunk;
+
+    portSeal(port);
+    SF(chunk, malloc, NULL, (sizeof(MuxChunk)));
+    chunk->adopt = sock;
+    chunk->listenerId = listenerId;
+    chunk->len = 0;
+    portQueue(port, chunk);
+}
+
+/* push as much of the backlog as fits, then wake the consumer if needed;
+ * returns true if there's still a backlog */
+static int portFlush(MuxPort *port)
+{
+    int pushed = 0;
+    uint64_t one = 1;
+    ssize_t tmpi;
+
+    portSeal(port);
+    while (port->backlog && ringPush(port->ring, port->backlog)) {
+        port->backlog = port->backlog->next;
+        pushed = 1;
+    }
+    if (!port->backlog) port->backlogTail = NULL;
+
+    if (pushed && atomic_exchange(&port->ring->sleeping, 0))
+        tmpi = write(port->wakeFd, &one, sizeof one);
+
+    return port->backlog != NULL;
+}
+
+/* link socket, used by workers */
+static void linkShouldSelect(Socket *self, int *r, int *w)
+{
+    *r = ((SocketLink *) self)->worker->wakeFd;
+    *w = -1;
+}
+
+static int linkSelectedR(Socket *self, int fd)
+{
+    uint64_t count;
+    ssize_t tmpi;
+
+    /* just clear the wakeup; the worker loop drains the ring */
+    tmpi = read(fd, &count, sizeof count);
+    return 0;
+}
+
+static void linkWrite(Socket *self, const void *buf, size_t count)
+{
+    MuxPort *port = &((SocketLink *) self)->worker->outPort;
+    WRITE_BUFFER(port->pending, buf, count);
+}
+
+/* hand a freshly accepted connection over to the link thread */
+void muxThreadAdopt(Socket *listener, Socket *sock)
+{
+    portAdopt(&thisWorker->outPort, sock, listener->id);
+}
+
+/* act on everything the link thread has sent us */
+static void workerDrain(MuxWorker *self)
+{
+    MuxChunk *chunk;
+    Socket *sock;
+    unsigned char idbuf[4];
+    size_t at, len;
+    int id;
+
+    while ((chunk = ringPop(&self->in))) {
+        if (chunk->adopt) {
+            /* a new connection, which now lives in our shard */
+            id = registerSocket(chunk->adopt, NULL);
+            muxCommand(stdoutSocket, 'c', chunk->listenerId);
+            muxPrepareInt(idbuf, id);
+            stdoutSocket->vtbl->write(stdoutSocket, idbuf, 4);
+            free(chunk);
+            continue;
+        }
+
+        for (at = 0; at < chunk->len; at += len) {
+            unsigned char *frame = chunk->data + at;
+            len = muxFrameLength(frame, chunk->len - at);
+            id = muxReadInt(frame + 1);
+
+            /* connectors are shared by every shard, so never free them */
+            sock = socketById(id);
+            if (frame[0] == 'd' && sock && sock->vtbl->connect) continue;
+
+            switch (frame[0]) {
+                case 's':
+                    muxDispatch('s', id, -1, frame + MUX_HEADER_S, len - MUX_HEADER_S);
+                    break;
+
+                case 'c':
+                    muxDispatch('c', id, muxReadInt(frame + 5), NULL, 0);
+                    break;
+
+                default:
+                    muxDispatch(frame[0], id, -1, frame, len);
+                    break;
+            }
+        }
+        free(chunk);
+    }
+}
+
+static void *workerMain(void *arg)
+{
+    MuxWorker *self = (MuxWorker *) arg;
+    SocketLink *link;
+    struct timeval zero, retry;
+    int i, backlog;
+
+    thisWorker = self;
+
+    link = (SocketLink *) newSocket(sizeof(SocketLink));
+    link->ssuper.vtbl = &linkVTbl;
+    link->worker = self;
+    initSocketShard(self->shard, muxThreads, (Socket *) link);
+
+    /* connectors are stateless, so every shard gets them; anything else only
+     * lives in the shard of its ID */
+    for (i = 2; i < nconfiguredSockets; i++) {
+        Socket *sock = configuredSockets[i];
+        if (sock && (sock->vtbl->connect || socketShardOf(i, muxThreads) == self->shard))
+            registerSocket(sock, &i);
+    }
+
+    backlog = 0;
+    while (1) {
+        zero.tv_sec = retry.tv_sec = 0;
+        zero.tv_usec = 0;
+        retry.tv_usec = 1000; /* arbitrary */
+
+        if (ringSleep(&self->in)) socketSelectOnce(&zero);
+        else socketSelectOnce(backlog ? &retry : NULL);
+        ringWake(&self->in);
+
+        workerDrain(self);
+        backlog = portFlush(&self->outPort);
+    }
+
+    return NULL;
+}
+
+/* the link thread */
+static void linkLoop()
+{
+    struct Buffer_char inbuf;
+    fd_set readfds, writefds;
+    struct timeval zero, retry, traceWait, *timeout;
+    MuxChunk *chunk;
+    ssize_t rd;
+    size_t at, len;
+    uint64_t count;
+    int i, nfds, busy, backlog, linkOpen, nextAdopt, shard, id, tmpi;
+
+    INIT_BUFFER(inbuf);
+    linkOpen = 1;
+    nextAdopt = 0;
+    backlog = 0;
+
+    while (1) {
+        /* figure out whether we may block */
+        busy = 0;
+        for (i = 0; i < muxThreads; i++)
+            busy |= ringSleep(&workers[i].out);
+
+        zero.tv_sec = retry.tv_sec = 0;
+        zero.tv_usec = 0;
+        retry.tv_usec = 1000; /* arbitrary */
+        timeout = busy ? &zero : backlog ? &retry : traceTimeout(&traceWait);
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        if (linkOpen) FD_SET(0, &readfds);
+        if (((SocketWritable *) stdoutSocket)->wbuf.bufused > 0) FD_SET(1, &writefds);
+        FD_SET(linkWakeFd, &readfds);
+        nfds = linkWakeFd + 1;
+
+        tmpi = select(nfds, &readfds, &writefds, NULL, timeout);
+        if (tmpi < 0 && errno != EINTR) {
+            perror("select");
+            exit(1);
+        }
+        if (tmpi < 0) {
+            FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
+        }
+
+        for (i = 0; i < muxThreads; i++)
+            ringWake(&workers[i].out);
+        if (FD_ISSET(linkWakeFd, &readfds))
+            rd = read(linkWakeFd, &count, sizeof count);
+
+        /* collect whatever the workers have for the other side */
+        for (i = 0; i < muxThreads; i++) {
+            while ((chunk = ringPop(&workers[i].out))) {
+                if (chunk->adopt) {
+                    portAdopt(&workers[nextAdopt].inPort, chunk->adopt, chunk->listenerId);
+                    nextAdopt = (nextAdopt + 1) % muxThreads;
+                } else {
+                    stdoutSocket->vtbl->write(stdoutSocket, chunk->data, chunk->len);
+                }
+                free(chunk);
+            }
+        }
+
+        /* read from the link and route each frame to its shard */
+        if (linkOpen && FD_ISSET(0, &readfds)) {
+            while (BUFFER_SPACE(inbuf) < MUX_READ_SIZE) EXPAND_BUFFER(inbuf);
+            rd = read(0, BUFFER_END(inbuf), BUFFER_SPACE(inbuf));
+            if (rd <= 0) {
+                fprintf(stderr, "Critical error! Lost stdin!\n");
+                linkOpen = 0;
+            } else {
+                STEP_BUFFER(inbuf, rd);
+            }
+
+            for (at = 0; at < inbuf.bufused; at += len) {
+                unsigned char *frame = (unsigned char *) inbuf.buf + at;
+                len = muxFrameLength(frame, inbuf.bufused - at);
+                if (len == 0) break;
+                if (len == (size_t) -1) {
+                    fprintf(stderr, "Critical error! Unrecognized command %d!\n", (int) frame[0]);
+                    linkOpen = 0;
+                    break;
+                }
+
+                /* link-level frames are ours */
+                if (frame[0] == 'p' || frame[0] == 'P' || frame[0] == 'r') {
+                    traceLinkCommand(frame);
+                    continue;
+                }
+                if (frame[0] == 't')
+                    traceReceived(frame);
+
+                /* new connections belong to the shard of their own ID */
+                id = muxReadInt(frame + (frame[0] == 'c' ? 5 : 1));
+                if (id < 2) continue;
+                shard = socketShardOf(id, muxThreads);
+                WRITE_BUFFER(workers[shard].inPort.pending, frame, len);
+            }
+            memmove(inbuf.buf, inbuf.buf + at, inbuf.bufused - at);
+            inbuf.bufused -= at;
+        }
+
+        backlog = 0;
+        for (i = 0; i < muxThreads; i++)
+            backlog |= portFlush(&workers[i].inPort);
+
+        if (FD_ISSET(1, &writefds) &&
+            stdoutSocket->vtbl->selectedW(stdoutSocket, 1) != 0) {
+            fprintf(stderr, "Critical error! Lost stdout!\n");
+            exit(1);
+        }
+
+        traceTick();
+    }
+}
+
+/* run in threaded mode */
+void muxThreadRun(int threads, Socket **configured, int nconfigured)
+{
+    sigset_t mask, orig;
+    int i, tmpi;
+
+    muxThreads = threads;
+    configuredSockets = configured;
+    nconfiguredSockets = nconfigured;
+
+    SF(linkWakeFd, eventfd, -1, (0, EFD_NONBLOCK));
+    SF(workers, calloc, NULL, (threads, sizeof(MuxWorker)));
+
+    for (i = 0; i < threads; i++) {
+        MuxWorker *w = &workers[i];
+        w->shard = i;
+        SF(w->wakeFd, eventfd, -1, (0, EFD_NONBLOCK));
+        initPort(&w->inPort, &w->in, w->wakeFd);
+        initPort(&w->outPort, &w->out, linkWakeFd);
+    }
+
+    /* signals are for the link thread */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &orig);
+    for (i = 0; i < threads; i++) {
+        tmpi = pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]);
+        if (tmpi != 0) {
+            fprintf(stderr, "Failed to start worker thread.\n");
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    linkLoop();
+}
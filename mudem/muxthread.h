@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MUXTHREAD_H
+#define MUXTHREAD_H
+
+#include "muxsocket.h"
+
+/* number of worker threads; 0 when running single-threaded */
+extern int muxThreads;
+
+/* hand a freshly accepted connection over to the link thread */
+void muxThreadAdopt(Socket *listener, Socket *sock);
+
+/* run in threaded mode: configured[i] is the socket for ID i, or NULL.
+ * Does not return. */
+void muxThreadRun(int threads, Socket **configured, int nconfigured);
+
+#endif
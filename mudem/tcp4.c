@@ -97,8 +97,7 @@ static void tcp4lShouldSelect(Socket *self, int *r, int *w)
 static int tcp4lSelectedR(Socket *self, int fd)
 {
     SocketTCP4 *tcp4;
-    int newfd, id;
-    unsigned char idbuf[4];
+    int newfd;
 
     /* accept it */
     newfd = accept(fd, NULL, NULL);
@@ -109,13 +108,8 @@ static int tcp4lSelectedR(Socket *self, int fd)
     newSocketWritable(tcp4, newfd);
     tcp4->ssuper.vtbl = &tcp4VTbl;
 
-    /* register it */
-    id = registerSocket((Socket *) tcp4, NULL);
-
-    /* then tell the other side */
-    muxCommand(stdoutSocket, 'c', self->id);
-    muxPrepareInt(idbuf, id);
-    stdoutSocket->vtbl->write(stdoutSocket, idbuf, 4);
+    /* register it and tell the other side */
+    socketAccepted(self, (Socket *) tcp4);
 
     return 0;
 }
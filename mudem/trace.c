@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Latency tracing. A sampled 's' frame is preceded by a 't' frame carrying a
+ * sequence number and the time its data was read from the socket. The sending
+ * side notes when the frame has been written to the link, the receiving side
+ * when it was read from the link, queued for its socket and written out, so
+ * each sample is split into a sender half and a receiver half. The side with a
+ * trace file collects both halves (the other side reports its halves in 'r'
+ * frames), corrects the remote timestamps by the clock offset estimated from
+ * 'p'/'P' ping-pongs, and writes the hops as a Chrome trace.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "muxsocket.h"
+#include "muxstdio.h"
+#include "trace.h"
+
+#define TRACE_PING_INTERVAL 1000000000LL /* ns */
+#define TRACE_PINGS 8 /* pings to pick the offset estimate from */
+#define TRACE_TABLE_SIZE 4096 /* incomplete samples; must be a power of two */
+#define TRACE_LINKED_MAX 256 /* sender halves waiting for traceTick */
+#define TRACE_HOPS 4
+#define TRACE_BUCKETS 32 /* log2 microseconds */
+
+#define HALF_SENDER 1
+#define HALF_RECEIVER 2
+
+int traceEnabled;
+
+static FILE *traceFile;
+static int traceReport, traceSampleEvery, traceSide, traceChannels;
+static int64_t traceStart;
+static _Atomic int32_t traceSeq;
+static volatile sig_atomic_t traceStopping;
+
+/* per-thread: sampling counter, and the last 't' frame dispatched */
+static __thread unsigned int traceCount;
+static __thread TraceSample *traceNext;
+
+/* link writer state: header being scanned, payload left to skip, and the
+ * sample whose 's' frame is going out */
+static unsigned char scanHeader[MUX_MAX_HEADER];
+static size_t scanHeaderLen, scanSkip;
+static TraceSample *scanSample;
+static TraceSample *traceLinked[TRACE_LINKED_MAX];
+static int traceLinkedCount;
+
+/* pinging */
+static int64_t nextPing;
+static int32_t pingSeq;
+static int64_t pingRtt[TRACE_PINGS], pingOffset[TRACE_PINGS];
+static int pings;
+
+/* collector state, shared by all threads */
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t traceOffset; /* remote clock - local clock */
+static TraceSample *traceTable[TRACE_TABLE_SIZE];
+static uint32_t *traceHist; /* [channel][origin][hop][bucket] */
+
+static const char *hopNames[TRACE_HOPS] = {
+    "mudem %d queue", "link %d->%d", "mudem %d queue", "application %d"
+};
+
+static int64_t traceNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void traceStop(int sig)
+{
+    traceStopping = 1;
+}
+
+/* write a JSON string */
+static void traceString(const char *s)
+{
+    fputc('"', traceFile);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', traceFile);
+        if ((unsigned char) *s >= 0x20) fputc(*s, traceFile);
+    }
+    fputc('"', traceFile);
+}
+
+/* initialize tracing */
+void initTrace(const char *file, int report, int sampleEvery, int preferredId, int channels)
+{
+    struct sigaction act;
+
+    traceEnabled = 1;
+    traceReport = report;
+    traceSampleEvery = sampleEvery > 0 ? sampleEvery : 1;
+    traceSide = preferredId;
+    traceChannels = channels;
+    traceStart = traceNow();
+    atomic_store(&traceSeq, preferredId);
+
+    if (!file) return;
+
+    SF(traceFile, fopen, NULL, (file, "w"));
+    fprintf(traceFile, "[\n");
+    SF(traceHist, calloc, NULL, (channels * 2 * TRACE_HOPS * TRACE_BUCKETS, sizeof(uint32_t)));
+
+    /* flush the trace and histograms when we're told to stop */
+    memset(&act, 0, sizeof act);
+    act.sa_handler = traceStop;
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+}
+
+/* give a channel a name for the trace */
+void traceNameChannel(int channel, const char *name)
+{
+    int side;
+
+    if (!traceFile) return;
+
+    fprintf(traceFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", channel);
+    traceString(name);
+    fprintf(traceFile, "}},\n");
+    for (side = 0; side < 2; side++)
+        fprintf(traceFile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%d->%d\"}},\n", channel, side, side, !side);
+}
+
+/* send data read from a socket */
+void traceOutgoing(Socket *sock)
+{
+    unsigned char buf[MUX_HEADER_T];
+
+    if (!traceEnabled || traceCount++ % traceSampleEvery != 0) return;
+
+    buf[0] = 't';
+    muxPrepareInt(buf + 1, sock->id);
+    muxPrepareInt(buf + 5, atomic_fetch_add(&traceSeq, 2));
+    muxPrepareInt(buf + 9, sock->channel);
+    muxPrepareInt64(buf + 13, traceNow());
+    muxPrepareInt64(buf + 21, 0); /* filled in by the receiver */
+    stdoutSocket->vtbl->write(stdoutSocket, buf, sizeof buf);
+}
+
+/* a 't' frame was read from the link */
+void traceReceived(unsigned char *frame)
+{
+    muxPrepareInt64(frame + 21, traceNow());
+}
+
+/* a 't' frame was dispatched */
+void traceSampled(const unsigned char *frame)
+{
+    TraceSample *sample;
+
+    SF(sample, calloc, NULL, (1, sizeof(TraceSample)));
+    sample->id = muxReadInt(frame + 1);
+    sample->seq = muxReadInt(frame + 5);
+    sample->channel = muxReadInt(frame + 9);
+    sample->t[0] = muxReadInt64(frame + 13);
+    sample->t[2] = muxReadInt64(frame + 21);
+
+    free(traceNext);
+    traceNext = sample;
+}
+
+/* add to the histogram and trace; called with traceLock held */
+static void traceEmit(TraceSample *s)
+{
+    int origin, i, hop, bucket;
+    int64_t us;
+    char name[32];
+
+    /* bring remote timestamps onto our clock */
+    origin = s->seq & 1;
+    for (i = 0; i < 5; i++) {
+        if ((i < 2 ? origin : !origin) != traceSide)
+            s->t[i] -= traceOffset;
+    }
+
+    for (hop = 0; hop < TRACE_HOPS; hop++) {
+        us = (s->t[hop + 1] - s->t[hop]) / 1000;
+        if (us < 0) us = 0;
+
+        if (s->channel >= 0 && s->channel < traceChannels) {
+            for (bucket = 0; bucket < TRACE_BUCKETS - 1 && us >= (1LL << bucket); bucket++);
+            traceHist[((s->channel * 2 + origin) * TRACE_HOPS + hop) * TRACE_BUCKETS + bucket]++;
+        }
+
+        snprintf(name, sizeof name, hopNames[hop], hop < 2 ? origin : !origin, !origin);
+        fprintf(traceFile, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%lld,\"dur\":%lld,\"args\":{\"id\":%d,\"seq\":%d}},\n",
+                name, s->channel, origin, (long long) (s->t[hop] - traceStart) / 1000,
+                (long long) us, s->id, s->seq);
+    }
+}
+
+/* merge in half of a sample */
+static void traceCollect(int32_t seq, int32_t id, int32_t channel, int half, const int64_t *t)
+{
+    TraceSample **slot, *s;
+
+    pthread_mutex_lock(&traceLock);
+
+    slot = &traceTable[seq & (TRACE_TABLE_SIZE - 1)];
+    if (*slot && (*slot)->seq != seq) {
+        /* the other half got lost; drop it */
+        free(*slot);
+        *slot = NULL;
+    }
+    if (!*slot)
+        SF(*slot, calloc, NULL, (1, sizeof(TraceSample)));
+    s = *slot;
+
+    s->seq = seq;
+    s->id = id;
+    s->channel = channel;
+    s->have |= half;
+    memcpy(half == HALF_SENDER ? s->t : s->t + 2, t, (half == HALF_SENDER ? 2 : 3) * sizeof(int64_t));
+
+    if (s->have == (HALF_SENDER | HALF_RECEIVER)) {
+        traceEmit(s);
+        free(s);
+        *slot = NULL;
+    }
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+/* hand over a finished half, either to the collector or to the other side */
+static void traceHalf(TraceSample *s, int half)
+{
+    unsigned char buf[MUX_HEADER_R];
+    const int64_t *t = half == HALF_SENDER ? s->t : s->t + 2;
+
+    if (traceFile) {
+        traceCollect(s->seq, s->id, s->channel, half, t);
+    } else if (traceReport) {
+        buf[0] = 'r';
+        muxPrepareInt(buf + 1, s->id);
+        muxPrepareInt(buf + 5, s->seq);
+        muxPrepareInt(buf + 9, s->channel);
+        buf[13] = half;
+        muxPrepareInt64(buf + 14, t[0]);
+        muxPrepareInt64(buf + 22, t[1]);
+        muxPrepareInt64(buf + 30, half == HALF_SENDER ? 0 : t[2]);
+        stdoutSocket->vtbl->write(stdoutSocket, buf, sizeof buf);
+    }
+
+    free(s);
+}
+
+/* data for a socket was dispatched into its buffer */
+void traceQueued(Socket *sock)
+{
+    TraceSample *sample = traceNext;
+    SocketWritable *sockw = (SocketWritable *) sock;
+
+    if (!sample || sample->id != sock->id) return;
+    traceNext = NULL;
+    sample->t[3] = traceNow();
+
+    /* wait for a writable socket to write it out, unless it's already
+     * waiting for another sample */
+    if (sock->vtbl->write == socketWritableWrite) {
+        if (sockw->trace) {
+            free(sample);
+        } else {
+            sockw->trace = sample;
+            sockw->traceAt = sockw->wbuf.bufused;
+        }
+        return;
+    }
+
+    sample->t[4] = sample->t[3];
+    traceHalf(sample, HALF_RECEIVER);
+}
+
+/* a SocketWritable wrote part of its buffer */
+void traceWritten(SocketWritable *sock, size_t wrote)
+{
+    if (wrote < sock->traceAt) {
+        sock->traceAt -= wrote;
+        return;
+    }
+
+    sock->trace->t[4] = traceNow();
+    traceHalf(sock->trace, HALF_RECEIVER);
+    sock->trace = NULL;
+}
+
+/* bytes were written to the link: find where sampled frames end */
+void traceLinkWrote(const unsigned char *buf, size_t count)
+{
+    size_t need, take;
+
+    while (count > 0) {
+        if (scanSkip > 0) {
+            take = count < scanSkip ? count : scanSkip;
+            buf += take;
+            count -= take;
+            scanSkip -= take;
+        } else {
+            need = muxHeaderLength(scanHeaderLen ? scanHeader[0] : buf[0]);
+            if (need == 0) break; /* can't happen, we only write what we know */
+            take = need - scanHeaderLen;
+            if (take > count) take = count;
+            memcpy(scanHeader + scanHeaderLen, buf, take);
+            scanHeaderLen += take;
+            buf += take;
+            count -= take;
+            if (scanHeaderLen < need) break;
+            scanHeaderLen = 0;
+
+            if (scanHeader[0] == 't') {
+                free(scanSample);
+                SF(scanSample, calloc, NULL, (1, sizeof(TraceSample)));
+                scanSample->id = muxReadInt(scanHeader + 1);
+                scanSample->seq = muxReadInt(scanHeader + 5);
+                scanSample->channel = muxReadInt(scanHeader + 9);
+                scanSample->t[0] = muxReadInt64(scanHeader + 13);
+                continue;
+            }
+            if (scanHeader[0] != 's') continue;
+            scanSkip = (size_t) muxReadInt(scanHeader + 5);
+        }
+
+        /* the sampled 's' frame is entirely out */
+        if (scanSkip == 0 && scanSample) {
+            scanSample->t[1] = traceNow();
+            if (traceLinkedCount < TRACE_LINKED_MAX)
+                traceLinked[traceLinkedCount++] = scanSample;
+            else
+                free(scanSample);
+            scanSample = NULL;
+        }
+    }
+}
+
+/* a link-level frame was read from the link */
+void traceLinkCommand(const unsigned char *frame)
+{
+    unsigned char buf[MUX_HEADER_PONG];
+    int64_t now = traceNow(), t[3];
+    int i, best;
+
+    switch (frame[0]) {
+        case 'p':
+            buf[0] = 'P';
+            memcpy(buf + 1, frame + 1, 12);
+            muxPrepareInt64(buf + 13, now);
+            stdoutSocket->vtbl->write(stdoutSocket, buf, sizeof buf);
+            break;
+
+        case 'P':
+            /* keep the estimate from the quickest recent round trip */
+            i = pings++ % TRACE_PINGS;
+            pingRtt[i] = now - muxReadInt64(frame + 5);
+            pingOffset[i] = muxReadInt64(frame + 13) - (muxReadInt64(frame + 5) + pingRtt[i] / 2);
+            best = 0;
+            for (i = 1; i < TRACE_PINGS && i < pings; i++)
+                if (pingRtt[i] < pingRtt[best]) best = i;
+            pthread_mutex_lock(&traceLock);
+            traceOffset = pingOffset[best];
+            pthread_mutex_unlock(&traceLock);
+            break;
+
+        case 'r':
+            if (!traceFile) break;
+            for (i = 0; i < 3; i++)
+                t[i] = muxReadInt64(frame + 14 + 8 * i);
+            traceCollect(muxReadInt(frame + 5), muxReadInt(frame + 1), muxReadInt(frame + 9), frame[13], t);
+            break;
+    }
+}
+
+/* how long the link thread may sleep */
+struct timeval *traceTimeout(struct timeval *tv)
+{
+    int64_t wait;
+
+    if (!traceFile) return NULL;
+
+    wait = nextPing - traceNow();
+    if (wait < 0 || traceStopping) wait = 0;
+    tv->tv_sec = wait / 1000000000LL;
+    tv->tv_usec = (wait % 1000000000LL) / 1000;
+    return tv;
+}
+
+/* write out the histograms and finish the trace */
+static void traceFinish()
+{
+    int channel, origin, hop, bucket;
+    uint32_t *hist, total;
+    char name[32];
+
+    pthread_mutex_lock(&traceLock);
+
+    for (channel = 0; channel < traceChannels; channel++) {
+        for (origin = 0; origin < 2; origin++) {
+            hist = traceHist + (channel * 2 + origin) * TRACE_HOPS * TRACE_BUCKETS;
+            for (total = 0, bucket = 0; bucket < TRACE_BUCKETS; bucket++)
+                total += hist[bucket];
+            if (total == 0) continue;
+
+            fprintf(stderr, "Latency on channel %d, %d->%d (%u samples, microseconds):\n",
+                    channel, origin, !origin, total);
+            for (hop = 0; hop < TRACE_HOPS; hop++, hist += TRACE_BUCKETS) {
+                snprintf(name, sizeof name, hopNames[hop], hop < 2 ? origin : !origin, !origin);
+                fprintf(stderr, "  %-16s", name);
+                for (bucket = 0; bucket < TRACE_BUCKETS; bucket++)
+                    if (hist[bucket])
+                        fprintf(stderr, " <%lld:%u", 1LL << bucket, hist[bucket]);
+                fprintf(stderr, "\n");
+            }
+        }
+    }
+
+    fprintf(traceFile, "{\"name\":\"clock_offset\",\"ph\":\"M\",\"pid\":0,\"args\":{\"ns\":%lld}}\n]\n",
+            (long long) traceOffset);
+    fclose(traceFile);
+    traceFile = NULL;
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+/* periodic work for the link thread */
+void traceTick()
+{
+    unsigned char buf[MUX_HEADER_PING];
+    int64_t now;
+    int i;
+
+    if (!traceEnabled) return;
+
+    if (traceStopping) {
+        traceFinish();
+        exit(0);
+    }
+
+    for (i = 0; i < traceLinkedCount; i++)
+        traceHalf(traceLinked[i], HALF_SENDER);
+    traceLinkedCount = 0;
+
+    now = traceNow();
+    if (traceFile && now >= nextPing) {
+        buf[0] = 'p';
+        muxPrepareInt(buf + 1, pingSeq++);
+        muxPrepareInt64(buf + 5, now);
+        stdoutSocket->vtbl->write(stdoutSocket, buf, sizeof buf);
+        nextPing = now + TRACE_PING_INTERVAL;
+    }
+}
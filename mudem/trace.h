@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "muxsocket.h"
+
+/* a sampled frame: sender half is read/linked, receiver half is
+ * received/queued/written */
+struct _TraceSample {
+    int32_t seq, id, channel;
+    int have; /* which halves we have */
+    int64_t t[5];
+};
+
+/* nonzero if tracing is enabled at all */
+extern int traceEnabled;
+
+/* initialize tracing; with a file, samples are collected and written to it,
+ * otherwise (report != 0) they're sent to the other side */
+void initTrace(const char *file, int report, int sampleEvery, int preferredId, int channels);
+
+/* give a channel (configured socket) a name for the trace */
+void traceNameChannel(int channel, const char *name);
+
+/* call before sending data read from a socket; may write a 't' frame */
+void traceOutgoing(Socket *sock);
+
+/* call as soon as a 't' frame has been read from the link */
+void traceReceived(unsigned char *frame);
+
+/* call when a 't' frame is dispatched on the thread owning its socket */
+void traceSampled(const unsigned char *frame);
+
+/* call after data for a socket has been dispatched into its buffer */
+void traceQueued(Socket *sock);
+
+/* call after a SocketWritable has written some of its buffer */
+void traceWritten(SocketWritable *sock, size_t wrote);
+
+/* call with bytes just written to the link */
+void traceLinkWrote(const unsigned char *buf, size_t count);
+
+/* call with a link-level ('p', 'P' or 'r') frame read from the link */
+void traceLinkCommand(const unsigned char *frame);
+
+/* how long the link thread may sleep, or NULL if forever */
+struct timeval *traceTimeout(struct timeval *tv);
+
+/* periodic work for the link thread: pings, reports and shutdown */
+void traceTick();
+
+#endif
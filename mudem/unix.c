@@ -94,8 +94,7 @@ static void unixlShouldSelect(Socket *self, int *r, int *w)
 static int unixlSelectedR(Socket *self, int fd)
 {
     SocketUNIX *sock;
-    int newfd, id;
-    unsigned char idbuf[4];
+    int newfd;
 
     /* accept it */
     newfd = accept(fd, NULL, NULL);
@@ -106,13 +105,8 @@ static int unixlSelectedR(Socket *self, int fd)
     newSocketWritable(sock, newfd);
     sock->ssuper.vtbl = &unixVTbl;
 
-    /* register it */
-    id = registerSocket((Socket *) sock, NULL);
-
-    /* then tell the other side */
-    muxCommand(stdoutSocket, 'c', self->id);
-    muxPrepareInt(idbuf, id);
-    stdoutSocket->vtbl->write(stdoutSocket, idbuf, 4);
+    /* register it and tell the other side */
+    socketAccepted(self, (Socket *) sock);
 
     return 0;
 }